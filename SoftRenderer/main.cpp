@@ -1,15 +1,51 @@
 #include <cstdint>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <fstream>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
 #include <vector>
+#include <deque>
 #include <algorithm>
 #include <array>
 #include <limits>
+#include <functional>
+#include <type_traits>
+#include <memory>
+#include <new>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#if defined(_WIN32)
+#include <io.h>
+#include <fcntl.h>
+#include <malloc.h>
+#elif defined(__linux__)
+#include <sys/mman.h>
+#endif
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
 #include <glm/mat4x4.hpp>
+#include <glm/geometric.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/constants.hpp>
+
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define SOFT_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define SOFT_TARGET_AVX2
+#else
+#define SOFT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
 
 typedef int8_t int8;
 typedef int16_t int16;
@@ -32,6 +68,7 @@ namespace math
 {
     float32 clamp(float32 _value, float32 _min = 0.f, float32 _max = 1.f);
     float32 lerp(float32 _a, float32 _b, float32 _t);
+    int popcount(uint32 _value);
 
     float32 clamp(float32 _value, float32 _min, float32 _max)
     {
@@ -44,409 +81,3436 @@ namespace math
     {
         return (_b - _a) * _t + _a;
     }
+
+    int popcount(uint32 _value)
+    {
+#if defined(__GNUC__)
+        return __builtin_popcount(_value);
+#else
+        _value = _value - ((_value >> 1) & 0x55555555);
+        _value = (_value & 0x33333333) + ((_value >> 2) & 0x33333333);
+        return (int)((((_value + (_value >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24);
+#endif
+    }
 }
 
-namespace video
+namespace cpu
 {
-    struct color
-    {
-        uint8 m_a = 255;
-        uint8 m_r = 0;
-        uint8 m_g = 0;
-        uint8 m_b = 0;
+    bool has_sse2();
+    bool has_avx2();
 
-        color()
-            : m_a(255), m_r(255), m_g(255), m_b(255)
-        { }
+    bool has_sse2()
+    {
+#if defined(SOFT_SIMD)
+        return true;
+#else
+        return false;
+#endif
+    }
 
-        color(uint8 _r, uint8 _g, uint8 _b, uint8 _a = 255)
-            : m_a(_a), m_r(_r), m_g(_g), m_b(_b)
-        { }
+    bool has_avx2()
+    {
+#if defined(SOFT_SIMD) && defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) {
+            return false;
+        }
 
-        color(uint32 _int)
-            : m_a((_int & 0x000000FF) >> 24), m_r((_int & 0x00FF) >> 16), m_g((_int & 0x0000FF) >> 8), m_b(_int & 0xFF)
-        { }
+        // the OS has to save the ymm registers too
+        __cpuid(info, 1);
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        bool avx = (info[2] & (1 << 28)) != 0;
+        if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6) {
+            return false;
+        }
 
-        const static color s_white;
-        const static color s_black;
-        const static color s_red;
-        const static color s_green;
-        const static color s_blue;
-        const static color s_magenta;
-        const static color s_yellow;
-        const static color s_cyan;
-    };
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+#elif defined(SOFT_SIMD)
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") != 0;
+#else
+        return false;
+#endif
+    }
+}
 
-    uint32 color_pack(const color& _color);
+namespace timing
+{
+    typedef std::chrono::steady_clock clock;
 
-    const color color::s_white = color{ 255, 255, 255 };
-    const color color::s_black = color{ 0, 0, 0 };
-    const color color::s_red = color{ 255, 0, 0 };
-    const color color::s_green = color{ 0, 255, 0 };
-    const color color::s_blue = color{ 0, 0, 255 };
-    const color color::s_magenta = color{ 255, 0, 255 };
-    const color color::s_yellow = color{ 255, 255, 0 };
-    const color color::s_cyan = color{ 0, 255, 255 };
+    float64 elapsed_ms(clock::time_point _start);
 
-    uint32 color_pack(const color& _color)
+    float64 elapsed_ms(clock::time_point _start)
     {
-        return (_color.m_a << 24) | (_color.m_r << 16) | (_color.m_g << 8) | (_color.m_b << 0);
+        return std::chrono::duration<float64, std::milli>(clock::now() - _start).count();
     }
+}
 
-    struct camera
+namespace memory
+{
+    enum class page_mode
     {
-        glm::vec3 m_position;
-        glm::vec3 m_target;
+        cSmall,
+        // asks the kernel to back the block with huge pages where it supports that
+        cTransparentHuge,
+        // reserved huge pages, transparent ones when none are available
+        cExplicitHuge,
     };
 
-    class mesh
+    static const size_t cSurfaceAlignment = 64;
+    static const size_t cHugePageSize = 2 * 1024 * 1024;
+
+    // m_capacity is how many bytes the block can hold, mapped blocks came from mmap instead of the heap
+    struct surface_block
     {
-    public:
-        mesh(glm::vec3* _vertices, int _vertCount, uint16* _indices, int _faceCount);
-        ~mesh();
+        void* m_data = nullptr;
+        size_t m_capacity = 0;
+        bool m_mapped = false;
+    };
 
-        struct face
-        {
-            uint16 m_a, m_b, m_c;
+    void* allocate_aligned(size_t _bytes, size_t _alignment);
+    void free_aligned(void* _data);
 
-            face(uint16 _a, uint16 _b, uint16 _c) : m_a(_a), m_b(_b), m_c(_c) {}
-        };
+    surface_block allocate_surface(size_t _bytes, page_mode _mode);
+    bool resize_surface(surface_block& _block, size_t _bytes);
+    void free_surface(surface_block& _block);
 
+    // standard allocator over the aligned heap, keeps container storage starting on a cache line
+    template <class T>
+    struct aligned_allocator
+    {
+        typedef T value_type;
+
+        aligned_allocator() = default;
+        template <class U>
+        aligned_allocator(const aligned_allocator<U>&) {}
+
+        T* allocate(size_t _count) { return (T*)allocate_aligned(_count * sizeof(T), cSurfaceAlignment); }
+        void deallocate(T* _data, size_t) { free_aligned(_data); }
+    };
+
+    template <class T, class U>
+    bool operator==(const aligned_allocator<T>&, const aligned_allocator<U>&) { return true; }
+    template <class T, class U>
+    bool operator!=(const aligned_allocator<T>&, const aligned_allocator<U>&) { return false; }
+
+    // cSurfaceAlignment aligned storage for device surfaces, contents are lost whenever resize has to move the block
+    template <class T>
+    class surface_buffer
+    {
     public:
-        std::vector<glm::vec3> m_vertices;
-        std::vector<face> m_faces;
-        glm::vec3 m_position;
-        glm::vec3 m_rotation;
+        surface_buffer() = default;
+        ~surface_buffer() { free_surface(m_block); }
+
+        surface_buffer(const surface_buffer&) = delete;
+        surface_buffer& operator=(const surface_buffer&) = delete;
+
+        void resize(size_t _count, page_mode _mode);
+        void release() { free_surface(m_block); }
+
+        T* data() const { return (T*)m_block.m_data; }
+        size_t capacity() const { return m_block.m_capacity / sizeof(T); }
+
+    private:
+        surface_block m_block;
     };
 
-    mesh::mesh(glm::vec3* _vertices, int _vertCount, uint16* _indices, int _faceCount)
-        : m_position(glm::vec3(0.f, 0.f, 0.f)),
-        m_rotation(glm::vec3(0.f, 0.f, 0.f))
+    void fill_streaming(uint32* _destination, size_t _count, uint32 _value);
+    void fill_streaming(float32* _destination, size_t _count, float32 _value);
+    void stream_fence();
+
+    // _bytes is rounded up to whole _alignment units, throws std::bad_alloc when the heap is out of memory
+    void* allocate_aligned(size_t _bytes, size_t _alignment)
     {
-        for (int i = 0; i < _vertCount; ++i) {
-            m_vertices.push_back(_vertices[i]);
+        size_t rounded = (std::max(_bytes, (size_t)1) + _alignment - 1) & ~(_alignment - 1);
+        void* result = nullptr;
+#if defined(_WIN32)
+        result = _aligned_malloc(rounded, _alignment);
+#else
+        if (posix_memalign(&result, _alignment, rounded) != 0) {
+            result = nullptr;
         }
-
-        for (int i = 0; i < _faceCount; ++i) {
-            mesh::face face = {
-                _indices[(i * 3) + 0],
-                _indices[(i * 3) + 1],
-                _indices[(i * 3) + 2],
-            };
-            m_faces.push_back(face);
+#endif
+        if (!result) {
+            throw std::bad_alloc();
         }
+        return result;
     }
 
-    mesh::~mesh()
+    void free_aligned(void* _data)
     {
+#if defined(_WIN32)
+        _aligned_free(_data);
+#else
+        free(_data);
+#endif
     }
 
-    class device
+    // blocks of at least a huge page are mapped on linux, rounded to whole huge pages and aligned to one so the
+    // kernel can back all of it. everything else comes from the aligned heap
+    surface_block allocate_surface(size_t _bytes, page_mode _mode)
     {
-    public:
-        device(int _width, int _height)
-            : m_width(_width), m_height(_height)
-        {
-            m_buffer = new uint32[m_width * m_height];
-            m_depthBuffer = new float32[m_width * m_height];
-        }
-
-        ~device()
-        {
-            delete m_buffer;
-            delete m_depthBuffer;
-        }
+        surface_block result;
+        _bytes = std::max(_bytes, cSurfaceAlignment);
 
-        enum class buffer_type
-        {
-            cColor,
-            cDepth,
-        };
-
-        void resize(int _width, int _height);
-        void clear(uint32 _value = 0xFF000000);
-        void poke(int _index, uint32 _value);
-        void put_pixel(int _x, int _y, float32 _depth, const color& _color);
-        void draw_point(const glm::vec3& _position, const color& _color);
-        void draw_line(const glm::vec3& _start, const glm::vec3& _end, const color& _color);
-        void draw_triangle(const glm::vec3& _v1, const glm::vec3& _v2, const glm::vec3& _v3, const color& _color);
-        void draw_hline(int _y, int _left, int _right, float32 _leftz, float32 _rightz, const color& _color);
-        glm::vec3 project(const glm::vec3& _position, const glm::mat4& _translationMatrix);
+#if defined(__linux__)
+        if (_mode != page_mode::cSmall && _bytes >= cHugePageSize) {
+            size_t rounded = (_bytes + cHugePageSize - 1) & ~(cHugePageSize - 1);
 
-        uint32* get_colors() const { return m_buffer; }
-        int get_width() const { return m_width; }
-        int get_height() const { return m_height; }
-        int get_size() const { return m_width * m_height; }
+            if (_mode == page_mode::cExplicitHuge) {
+                void* mapped = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if (mapped != MAP_FAILED) {
+                    result.m_data = mapped;
+                    result.m_capacity = rounded;
+                    result.m_mapped = true;
+                    return result;
+                }
+            }
 
-        SDL_Surface* create_surface(buffer_type _bufferType = buffer_type::cColor);
+            void* mapped = mmap(nullptr, rounded + cHugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mapped != MAP_FAILED) {
+                uintptr_t start = (uintptr_t)mapped;
+                uintptr_t aligned = (start + cHugePageSize - 1) & ~(uintptr_t)(cHugePageSize - 1);
+                if (aligned > start) {
+                    munmap(mapped, aligned - start);
+                }
+                size_t tail = (start + rounded + cHugePageSize) - (aligned + rounded);
+                if (tail > 0) {
+                    munmap((void*)(aligned + rounded), tail);
+                }
+                madvise((void*)aligned, rounded, MADV_HUGEPAGE);
 
-        int index_from_xy(int _x, int _y) const
-        {
-            int result = m_width * _y + _x;
-            if (result < 0 || result >= m_width * m_height) {
-                return -1;
+                result.m_data = (void*)aligned;
+                result.m_capacity = rounded;
+                result.m_mapped = true;
+                return result;
             }
-            return result;
         }
+#else
+        (void)_mode;
+#endif
 
-        void xy_from_index(int _index, int& _x, int& _y) const
-        {
-            _x = _index % m_width;
-            _y = _index / m_width;
+        size_t rounded = (_bytes + cSurfaceAlignment - 1) & ~(cSurfaceAlignment - 1);
+        result.m_data = allocate_aligned(rounded, cSurfaceAlignment);
+        result.m_capacity = rounded;
+        return result;
+    }
+
+    // true when the block now holds _bytes without having moved, either it already did or the mapping could grow
+    bool resize_surface(surface_block& _block, size_t _bytes)
+    {
+        if (_block.m_data && _bytes <= _block.m_capacity) {
+            return true;
         }
 
-        void render(const camera& _camera, mesh* _meshes, int _meshCount);
+#if defined(__linux__) && defined(MREMAP_MAYMOVE)
+        if (_block.m_mapped) {
+            size_t rounded = (_bytes + cHugePageSize - 1) & ~(cHugePageSize - 1);
+            if (mremap(_block.m_data, _block.m_capacity, rounded, 0) != MAP_FAILED) {
+                madvise((byte*)_block.m_data + _block.m_capacity, rounded - _block.m_capacity, MADV_HUGEPAGE);
+                _block.m_capacity = rounded;
+                return true;
+            }
+        }
+#endif
 
-    private:
-        int m_width = 0;
-        int m_height = 0;
-        uint32* m_buffer = nullptr;
-        float32* m_depthBuffer = nullptr;
-    };
+        return false;
+    }
 
-    void device::resize(int _width, int _height)
+    void free_surface(surface_block& _block)
     {
-        m_width = _width;
-        m_height = _height;
-
-        delete m_buffer;
-        delete m_depthBuffer;
+        if (!_block.m_data) {
+            return;
+        }
 
-        m_buffer = new uint32[m_width * m_height];
-        m_depthBuffer = new float32[m_width * m_height];
+#if defined(__linux__)
+        if (_block.m_mapped) {
+            munmap(_block.m_data, _block.m_capacity);
+        }
+        else {
+            free_aligned(_block.m_data);
+        }
+#else
+        free_aligned(_block.m_data);
+#endif
 
-        clear();
+        _block = surface_block();
     }
 
-    void device::clear(uint32 _value /* = 0xFF000000 */)
+    template <class T>
+    void surface_buffer<T>::resize(size_t _count, page_mode _mode)
     {
-        int size = m_width * m_height;
-        for (int i = 0; i < size; ++i) {
-            m_buffer[i] = _value;
-            m_depthBuffer[i] = std::numeric_limits<float32>::max();
+        if (resize_surface(m_block, _count * sizeof(T))) {
+            return;
         }
-    }
 
-    void device::poke(int _index, uint32 _value)
-    {
-        m_buffer[_index] = _value;
+        free_surface(m_block);
+        m_block = allocate_surface(_count * sizeof(T), _mode);
     }
 
-    void device::put_pixel(int _x, int _y, float32 _depth, const color& _color)
+    // non-temporal stores, the filled memory is not pulled into the cache, call stream_fence before other threads read it
+    void fill_streaming(uint32* _destination, size_t _count, uint32 _value)
     {
-        int index = index_from_xy(_x, _y);
-        if (index < 0) {
-            return;
+#if defined(SOFT_SIMD)
+        while (_count > 0 && ((uintptr_t)_destination & 15) != 0) {
+            *_destination++ = _value;
+            --_count;
         }
 
-        if (m_depthBuffer[index] < _depth) {
-            return;
+        __m128i wide = _mm_set1_epi32((int)_value);
+        for (; _count >= 16; _count -= 16, _destination += 16) {
+            _mm_stream_si128((__m128i*)_destination + 0, wide);
+            _mm_stream_si128((__m128i*)_destination + 1, wide);
+            _mm_stream_si128((__m128i*)_destination + 2, wide);
+            _mm_stream_si128((__m128i*)_destination + 3, wide);
         }
 
-        m_depthBuffer[index] = _depth;
-        poke(index, color_pack(_color));
+        for (; _count >= 4; _count -= 4, _destination += 4) {
+            _mm_stream_si128((__m128i*)_destination, wide);
+        }
+#endif
+
+        while (_count > 0) {
+            *_destination++ = _value;
+            --_count;
+        }
     }
 
-    void device::draw_point(const glm::vec3& _position, const color& _color)
+    void fill_streaming(float32* _destination, size_t _count, float32 _value)
     {
-        put_pixel((int)_position.x, (int)_position.y, _position.z, _color);
+        uint32 bits;
+        memcpy(&bits, &_value, sizeof(bits));
+        fill_streaming((uint32*)_destination, _count, bits);
     }
 
-    void device::draw_line(const glm::vec3& _start, const glm::vec3& _end, const color& _color)
+    void stream_fence()
     {
-        glm::ivec3 start(_start);
-        glm::ivec3 end(_end);
+#if defined(SOFT_SIMD)
+        _mm_sfence();
+#endif
+    }
+}
 
-        auto delta = glm::abs(end - start);
-        auto sx = (start.x < end.x) ? 1 : -1;
-        auto sy = (start.y < end.y) ? 1 : -1;
-        auto err = delta.x - delta.y;
+namespace jobs
+{
+    // counts the unfinished tasks of one batch, scheduler::wait runs other tasks until it reaches zero
+    class task_group
+    {
+    public:
+        bool is_done() const { return m_pending.load(std::memory_order_acquire) == 0; }
 
-        glm::ivec3 current = start;
+    private:
+        friend class scheduler;
+        std::atomic<int> m_pending{ 0 };
+    };
 
-        while (true) {
-            draw_point(glm::vec3(current), _color);
+    // work stealing pool, every worker pops the newest task of its own deque and steals the oldest of the others.
+    // deque 0 is a shared injection queue for threads outside the pool, they only take its oldest task or steal
+    class scheduler
+    {
+    public:
+        static const int cAnyWorker = -1;
 
-            if (current == end) {
-                break;
-            }
+        explicit scheduler(int _threadCount = 0);
+        ~scheduler();
 
-            auto e2 = err * 2;
+        scheduler(const scheduler&) = delete;
+        scheduler& operator=(const scheduler&) = delete;
 
-            if (e2 > -delta.y) {
-                err -= delta.y;
-                current.x += sx;
-            }
+        // _affinity in [0, get_thread_count()) is a hint only, the task starts on that worker's deque but may be
+        // stolen. worker 0 is the injection queue, drained first by the thread that waits
+        void submit(task_group& _group, std::function<void()> _task, int _affinity = cAnyWorker);
+        void wait(task_group& _group);
 
-            if (e2 < delta.x) {
-                err += delta.x;
-                current.y += sy;
-            }
+        // runs _job(0) .. _job(_count - 1) in batches of _grain, batch n is hinted to worker n so repeated
+        // calls over the same data keep it in the same caches
+        void parallel_for(int _count, const std::function<void(int)>& _job, int _grain = 1);
+
+        int get_thread_count() const { return (int)m_queues.size(); }
+
+        // shared by every device so stages never oversubscribe, set the count before the first get_default
+        static scheduler& get_default();
+        static void set_default_thread_count(int _threadCount);
+
+    private:
+        struct task
+        {
+            std::function<void()> m_function;
+            task_group* m_group;
+        };
+
+        // padded so neighbouring queues do not share a cache line
+        struct queue
+        {
+            std::mutex m_mutex;
+            std::deque<task> m_tasks;
+            uint8 m_padding[64];
+        };
+
+        // idle workers and waiters yield this many times before sleeping, enough to bridge the gap between stages of a frame
+        static const int cSpinCount = 256;
+        static const int cOutsidePool = -1;
+
+        void worker_main(int _index);
+        void push(int _queue, task&& _task);
+        void wake_all();
+        bool run_one(int _index);
+        bool pop(int _index, task& _task);
+        bool steal(int _index, task& _task);
+
+        std::vector<std::unique_ptr<queue>> m_queues;
+        std::vector<std::thread> m_threads;
+        std::atomic<int> m_queued{ 0 };
+        std::atomic<uint32> m_nextQueue{ 0 };
+        std::mutex m_sleepMutex;
+        std::condition_variable m_wake;
+        bool m_quit = false;
+
+        static thread_local int s_workerIndex;
+        static int s_defaultThreadCount;
+    };
+
+    // fixed capacity fifo between two threads, push blocks while it is full and pop while it is empty
+    template <class T>
+    class bounded_queue
+    {
+    public:
+        explicit bounded_queue(size_t _capacity) : m_capacity(_capacity) {}
+
+        void push(T _value);
+        T pop();
+
+    private:
+        size_t m_capacity;
+        std::deque<T> m_values;
+        std::mutex m_mutex;
+        std::condition_variable m_notFull;
+        std::condition_variable m_notEmpty;
+    };
+
+    template <class T>
+    void bounded_queue<T>::push(T _value)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_notFull.wait(lock, [this]() { return m_values.size() < m_capacity; });
+            m_values.push_back(std::move(_value));
         }
+        m_notEmpty.notify_one();
     }
 
-    void device::draw_hline(int _y, int _left, int _right, float32 _leftz, float32 _rightz, const color& _color)
+    template <class T>
+    T bounded_queue<T>::pop()
     {
-        if (_y < 0 || _y >= m_height) {
-            return;
+        T result;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_notEmpty.wait(lock, [this]() { return !m_values.empty(); });
+            result = std::move(m_values.front());
+            m_values.pop_front();
         }
+        m_notFull.notify_one();
+        return result;
+    }
 
-        int left = std::max(0, _left);
-        int right = std::min(_right, m_width);
+    thread_local int scheduler::s_workerIndex = scheduler::cOutsidePool;
+    int scheduler::s_defaultThreadCount = 0;
 
-        if (left > m_width && right > m_width) {
-            std::cout << "what\n";
+    scheduler::scheduler(int _threadCount /* = 0 */)
+    {
+        if (_threadCount <= 0) {
+            _threadCount = std::max((int)std::thread::hardware_concurrency(), 1);
         }
 
-        if (right < left) {
-            std::swap(left, right);
-        }
-        else if (left == right) {
-            draw_point(glm::vec3(left, _y, _leftz), _color);
+        for (int i = 0; i < _threadCount; ++i) {
+            m_queues.emplace_back(new queue());
         }
 
-        int distance = right - left;
-        for (int x = left; x < right; ++x) {
-            if (x < 0 || x >= m_width) {
-                continue;
-            }
-            glm::vec3 point((float32)x, (float32)_y, math::lerp(_leftz, _rightz, (float32)x / (float32)distance));
-            draw_point(point, _color);
+        for (int i = 1; i < _threadCount; ++i) {
+            m_threads.emplace_back(&scheduler::worker_main, this, i);
         }
     }
 
-    void device::draw_triangle(const glm::vec3& _v1, const glm::vec3& _v2, const glm::vec3& _v3, const color& _color)
+    scheduler::~scheduler()
     {
-        std::array<glm::vec3, 3> verts = {
-            { _v1, _v2, _v3 }
-        };
-
-        std::sort(verts.begin(), verts.end(), [](const glm::ivec3& _a, const glm::ivec3& _b) {
-            return _a.y < _b.y;
-        });
-
-        auto top = verts[0];
-        auto mid = verts[1];
-        auto bot = verts[2];
-
         {
-            float32 leftdx = (bot.x - top.x) / (bot.y - top.y);
-            float32 rightdx = (mid.x - top.x) / (mid.y - top.y);
-            float32 leftdz = (bot.z - top.z) / (bot.y - top.y);
-            float32 rightdz = (mid.z - top.z) / (mid.y / top.y);
-
-            if (mid.x < bot.x) {
-                std::swap(leftdx, rightdx);
-                std::swap(leftdz, rightdz);
-            }
-
-            glm::vec3 left, right;
-            left = right = top;
-            for (int y = top.y; y < mid.y; ++y) {
-                draw_hline(y, (int)left.x, (int)right.x, left.z, right.z, _color);
-                left.x += leftdx;
-                right.x += rightdx;
-                left.z += leftdz;
-                right.z += rightdz;
-            }
+            std::lock_guard<std::mutex> lock(m_sleepMutex);
+            m_quit = true;
         }
+        m_wake.notify_all();
 
-        {
-            float32 leftdx = (top.x - bot.x) / (top.y - bot.y);
-            float32 rightdx = (mid.x - bot.x) / (mid.y - bot.y);
-            float32 leftdz = (top.z - bot.z) / (top.y - bot.y);
-            float32 rightdz = (mid.z - bot.z) / (top.y - bot.y);
-
-            if (mid.x < top.x) {
-               std::swap(leftdx, rightdx);
-               std::swap(leftdz, rightdz);
-            }
-
-            glm::vec3 left, right;
-            left = right = bot;
-            for (int y = bot.y; y >= mid.y; --y) {
-                draw_hline(y, (int)left.x, (int)right.x, left.z, right.z, _color);
-                left.x -= leftdx;
-                right.x -= rightdx;
-                left.z -= leftdz;
-                right.z -= rightdz;
-            }
+        for (auto& thread : m_threads) {
+            thread.join();
         }
     }
 
-    glm::vec3 device::project(const glm::vec3& _position, const glm::mat4& _translationMatrix)
+    scheduler& scheduler::get_default()
     {
-        auto point = _translationMatrix * glm::vec4(_position, 1.f);
-        point /= point.w;
-        float32 x = point.x * m_width + m_width / 2.f;
-        float32 y = -point.y * m_height + m_height / 2.f;
-        return glm::vec3(x, y, point.z);
+        static scheduler s_scheduler(s_defaultThreadCount);
+        return s_scheduler;
     }
 
-    SDL_Surface* device::create_surface(buffer_type _bufferType)
+    void scheduler::set_default_thread_count(int _threadCount)
     {
-        switch (_bufferType) {
-            default:
-            case buffer_type::cColor:
-                return SDL_CreateRGBSurfaceFrom(m_buffer, m_width, m_height, 32, m_width * 4, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+        s_defaultThreadCount = _threadCount;
+    }
+
+    void scheduler::submit(task_group& _group, std::function<void()> _task, int _affinity /* = cAnyWorker */)
+    {
+        _group.m_pending.fetch_add(1, std::memory_order_relaxed);
+
+        int count = (int)m_queues.size();
+        int target = _affinity == cAnyWorker ? (int)(m_nextQueue++ % count) : _affinity % count;
+        push(target, task{ std::move(_task), &_group });
+        wake_all();
+    }
+
+    // sleeps once spinning runs out, but still wakes for queued tasks so a worker blocked in a nested wait keeps
+    // the pool from starving
+    void scheduler::wait(task_group& _group)
+    {
+        int spin = 0;
+        while (!_group.is_done()) {
+            if (run_one(s_workerIndex)) {
+                spin = 0;
+                continue;
+            }
+
+            if (spin++ < cSpinCount) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(m_sleepMutex);
+            m_wake.wait(lock, [this, &_group]() { return _group.is_done() || m_queued.load(std::memory_order_acquire) > 0; });
+            spin = 0;
+        }
+    }
+
+    void scheduler::parallel_for(int _count, const std::function<void(int)>& _job, int _grain /* = 1 */)
+    {
+        if (_count <= 0) {
+            return;
+        }
+
+        _grain = std::max(_grain, 1);
+        if (m_threads.empty() || _count <= _grain) {
+            for (int i = 0; i < _count; ++i) {
+                _job(i);
+            }
+            return;
+        }
+
+        task_group group;
+        int batches = (_count + _grain - 1) / _grain;
+        group.m_pending.fetch_add(batches, std::memory_order_relaxed);
+
+        for (int batch = 0; batch < batches; ++batch) {
+            int begin = batch * _grain;
+            int end = std::min(begin + _grain, _count);
+            auto function = [&_job, begin, end]() {
+                for (int i = begin; i < end; ++i) {
+                    _job(i);
+                }
+            };
+            push(batch % (int)m_queues.size(), task{ function, &group });
+        }
+        wake_all();
+
+        wait(group);
+    }
+
+    void scheduler::push(int _queue, task&& _task)
+    {
+        queue& target = *m_queues[_queue];
+        {
+            std::lock_guard<std::mutex> lock(target.m_mutex);
+            target.m_tasks.push_back(std::move(_task));
+        }
+        m_queued.fetch_add(1, std::memory_order_release);
+    }
+
+    // taking the sleep lock orders the wake against a worker that checked m_queued and is about to sleep
+    void scheduler::wake_all()
+    {
+        if (m_threads.empty()) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_sleepMutex);
+        }
+        m_wake.notify_all();
+    }
+
+    void scheduler::worker_main(int _index)
+    {
+        s_workerIndex = _index;
+
+        while (true) {
+            if (run_one(_index)) {
+                continue;
+            }
+
+            for (int spin = 0; spin < cSpinCount && m_queued.load(std::memory_order_acquire) == 0; ++spin) {
+                std::this_thread::yield();
+            }
+
+            std::unique_lock<std::mutex> lock(m_sleepMutex);
+            m_wake.wait(lock, [this]() { return m_quit || m_queued.load(std::memory_order_acquire) > 0; });
+            if (m_quit) {
+                return;
+            }
+        }
+    }
+
+    bool scheduler::run_one(int _index)
+    {
+        task current;
+        if (!pop(_index, current) && !steal(_index, current)) {
+            return false;
+        }
+
+        current.m_function();
+        if (current.m_group->m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            wake_all();
+        }
+        return true;
+    }
+
+    // the injection queue has no owner, threads outside the pool only reach it through steal
+    bool scheduler::pop(int _index, task& _task)
+    {
+        if (_index == cOutsidePool) {
+            return false;
+        }
+
+        queue& own = *m_queues[_index];
+        std::lock_guard<std::mutex> lock(own.m_mutex);
+        if (own.m_tasks.empty()) {
+            return false;
+        }
+
+        _task = std::move(own.m_tasks.back());
+        own.m_tasks.pop_back();
+        m_queued.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool scheduler::steal(int _index, task& _task)
+    {
+        int count = (int)m_queues.size();
+        int start = std::max(_index, 0);
+        for (int offset = 0; offset < count; ++offset) {
+            int victimIndex = (start + offset) % count;
+            if (victimIndex == _index) {
+                continue;
+            }
+
+            queue& victim = *m_queues[victimIndex];
+            std::lock_guard<std::mutex> lock(victim.m_mutex);
+            if (victim.m_tasks.empty()) {
+                continue;
+            }
+
+            _task = std::move(victim.m_tasks.front());
+            victim.m_tasks.pop_front();
+            m_queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        return false;
+    }
+}
+
+namespace video
+{
+    struct color
+    {
+        uint8 m_a = 255;
+        uint8 m_r = 0;
+        uint8 m_g = 0;
+        uint8 m_b = 0;
+
+        color()
+            : m_a(255), m_r(255), m_g(255), m_b(255)
+        { }
+
+        color(uint8 _r, uint8 _g, uint8 _b, uint8 _a = 255)
+            : m_a(_a), m_r(_r), m_g(_g), m_b(_b)
+        { }
+
+        color(uint32 _int)
+            : m_a((_int & 0x000000FF) >> 24), m_r((_int & 0x00FF) >> 16), m_g((_int & 0x0000FF) >> 8), m_b(_int & 0xFF)
+        { }
+
+        const static color s_white;
+        const static color s_black;
+        const static color s_red;
+        const static color s_green;
+        const static color s_blue;
+        const static color s_magenta;
+        const static color s_yellow;
+        const static color s_cyan;
+    };
+
+    uint32 color_pack(const color& _color);
+
+    const color color::s_white = color{ 255, 255, 255 };
+    const color color::s_black = color{ 0, 0, 0 };
+    const color color::s_red = color{ 255, 0, 0 };
+    const color color::s_green = color{ 0, 255, 0 };
+    const color color::s_blue = color{ 0, 0, 255 };
+    const color color::s_magenta = color{ 255, 0, 255 };
+    const color color::s_yellow = color{ 255, 255, 0 };
+    const color color::s_cyan = color{ 0, 255, 255 };
+
+    uint32 color_pack(const color& _color)
+    {
+        return (_color.m_a << 24) | (_color.m_r << 16) | (_color.m_g << 8) | (_color.m_b << 0);
+    }
+
+    struct camera
+    {
+        glm::vec3 m_position;
+        glm::vec3 m_target;
+    };
+
+    // planes point inwards, a point p is inside when dot(plane.xyz, p) + plane.w >= 0 for all of them
+    struct frustum
+    {
+        glm::vec4 m_planes[6];
+
+        static frustum from_matrix(const glm::mat4& _viewProjection);
+
+        bool intersects_sphere(const glm::vec3& _center, float32 _radius) const;
+        bool intersects_box(const glm::vec3& _min, const glm::vec3& _max) const;
+    };
+
+    frustum frustum::from_matrix(const glm::mat4& _viewProjection)
+    {
+        auto row = [&](int _row) {
+            return glm::vec4(_viewProjection[0][_row], _viewProjection[1][_row], _viewProjection[2][_row], _viewProjection[3][_row]);
+        };
+
+        frustum result;
+        result.m_planes[0] = row(3) + row(0);
+        result.m_planes[1] = row(3) - row(0);
+        result.m_planes[2] = row(3) + row(1);
+        result.m_planes[3] = row(3) - row(1);
+        result.m_planes[4] = row(3) + row(2);
+        result.m_planes[5] = row(3) - row(2);
+
+        for (auto& plane : result.m_planes) {
+            plane /= glm::length(glm::vec3(plane));
+        }
+
+        return result;
+    }
+
+    bool frustum::intersects_sphere(const glm::vec3& _center, float32 _radius) const
+    {
+        for (const auto& plane : m_planes) {
+            if (glm::dot(glm::vec3(plane), _center) + plane.w < -_radius) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool frustum::intersects_box(const glm::vec3& _min, const glm::vec3& _max) const
+    {
+        for (const auto& plane : m_planes) {
+            glm::vec3 positive(
+                plane.x >= 0.f ? _max.x : _min.x,
+                plane.y >= 0.f ? _max.y : _min.y,
+                plane.z >= 0.f ? _max.z : _min.z);
+
+            if (glm::dot(glm::vec3(plane), positive) + plane.w < 0.f) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    struct shader_program;
+    class texture;
+
+    class mesh
+    {
+    public:
+        mesh(glm::vec3* _vertices, int _vertCount, uint16* _indices, int _faceCount);
+        ~mesh();
+
+        // call again after editing m_vertices
+        void update();
+        void compute_bounds();
+        void build_streams();
+        glm::mat4 get_world_matrix() const;
+
+        static const int cStreamPadding = 8;
+
+        struct face
+        {
+            uint16 m_a, m_b, m_c;
+
+            face(uint16 _a, uint16 _b, uint16 _c) : m_a(_a), m_b(_b), m_c(_c) {}
+        };
+
+    public:
+        std::vector<glm::vec3> m_vertices;
+        std::vector<face> m_faces;
+        glm::vec3 m_position;
+        glm::vec3 m_rotation;
+
+        // occluders are drawn into the occlusion buffer first, every other mesh is tested against it
+        bool m_occluder = false;
+
+        // m_varyingCount floats per vertex for the program's vertex stage to read
+        int m_varyingCount = 0;
+        std::vector<float32> m_varyings;
+
+        // nullptr draws with device::get_default_program
+        const shader_program* m_program = nullptr;
+        const texture* m_texture = nullptr;
+
+        // local space
+        glm::vec3 m_boundsMin;
+        glm::vec3 m_boundsMax;
+        glm::vec3 m_sphereCenter;
+        float32 m_sphereRadius = 0.f;
+
+        // m_vertices split into x/y/z streams padded to cStreamPadding for the batch transform
+        std::vector<float32> m_streamX;
+        std::vector<float32> m_streamY;
+        std::vector<float32> m_streamZ;
+    };
+
+    mesh::mesh(glm::vec3* _vertices, int _vertCount, uint16* _indices, int _faceCount)
+        : m_position(glm::vec3(0.f, 0.f, 0.f)),
+        m_rotation(glm::vec3(0.f, 0.f, 0.f))
+    {
+        for (int i = 0; i < _vertCount; ++i) {
+            m_vertices.push_back(_vertices[i]);
+        }
+
+        for (int i = 0; i < _faceCount; ++i) {
+            mesh::face face = {
+                _indices[(i * 3) + 0],
+                _indices[(i * 3) + 1],
+                _indices[(i * 3) + 2],
+            };
+            m_faces.push_back(face);
+        }
+
+        update();
+    }
+
+    void mesh::update()
+    {
+        compute_bounds();
+        build_streams();
+    }
+
+    void mesh::build_streams()
+    {
+        size_t padded = (m_vertices.size() + cStreamPadding - 1) / cStreamPadding * cStreamPadding;
+        m_streamX.assign(padded, 0.f);
+        m_streamY.assign(padded, 0.f);
+        m_streamZ.assign(padded, 0.f);
+
+        for (size_t i = 0; i < m_vertices.size(); ++i) {
+            m_streamX[i] = m_vertices[i].x;
+            m_streamY[i] = m_vertices[i].y;
+            m_streamZ[i] = m_vertices[i].z;
+        }
+    }
+
+    void mesh::compute_bounds()
+    {
+        m_boundsMin = m_boundsMax = m_sphereCenter = glm::vec3(0.f, 0.f, 0.f);
+        m_sphereRadius = 0.f;
+
+        if (m_vertices.empty()) {
+            return;
+        }
+
+        m_boundsMin = m_boundsMax = m_vertices[0];
+        for (const auto& vertex : m_vertices) {
+            m_boundsMin = glm::min(m_boundsMin, vertex);
+            m_boundsMax = glm::max(m_boundsMax, vertex);
+        }
+
+        m_sphereCenter = (m_boundsMin + m_boundsMax) * 0.5f;
+        for (const auto& vertex : m_vertices) {
+            m_sphereRadius = std::max(m_sphereRadius, glm::length(vertex - m_sphereCenter));
+        }
+    }
+
+    glm::mat4 mesh::get_world_matrix() const
+    {
+        glm::mat4 rotation = glm::rotate(glm::mat4(1.f), m_rotation.y, glm::vec3(0.f, 1.f, 0.f));
+        rotation = glm::rotate(rotation, m_rotation.x, glm::vec3(1.f, 0.f, 0.f));
+        rotation = glm::rotate(rotation, m_rotation.z, glm::vec3(0.f, 0.f, 1.f));
+
+        glm::mat4 translation = glm::translate(glm::mat4(1.f), m_position);
+        return translation * rotation;
+    }
+
+    mesh::~mesh()
+    {
+    }
+
+    // argb8888 texels with a full mip chain, wrapping in both directions
+    class texture
+    {
+    public:
+        enum class filter
+        {
+            cNearest,
+            cBilinear,
+            cTrilinear,
+        };
+
+        // blocked stores 4x4 texel blocks contiguously, one 64 byte cache line each, so a bilinear
+        // footprint stays within one or two lines whatever the orientation of the triangle
+        enum class layout
+        {
+            cLinear,
+            cBlocked,
+        };
+
+        static const int cBlockBits = 2;
+        static const int cBlockSize = 1 << cBlockBits;
+
+        bool load(const char* _path, layout _layout = layout::cBlocked);
+        // fails on empty images and leaves the texture without levels
+        bool create(int _width, int _height, const uint32* _texels, layout _layout = layout::cBlocked);
+
+        // _lod is log2 of the footprint in level 0 texels, see compute_lod. a texture without levels samples magenta
+        uint32 sample(float32 _u, float32 _v, float32 _lod, filter _filter) const;
+        float32 compute_lod(float32 _dudx, float32 _dvdx, float32 _dudy, float32 _dvdy) const;
+
+        int get_width() const { return m_levels.empty() ? 0 : m_levels[0].m_width; }
+        int get_height() const { return m_levels.empty() ? 0 : m_levels[0].m_height; }
+        int get_level_count() const { return (int)m_levels.size(); }
+        layout get_layout() const { return m_layout; }
+
+    private:
+        // cache line aligned so a 4x4 block never straddles two lines
+        typedef std::vector<uint32, memory::aligned_allocator<uint32>> texel_storage;
+
+        // m_pitch is in texels for linear levels and in blocks for blocked ones
+        struct level
+        {
+            int m_width = 0;
+            int m_height = 0;
+            int m_pitch = 0;
+            texel_storage m_texels;
+        };
+
+        void build_mips();
+        void convert_level(level& _level) const;
+
+        template <layout Layout>
+        uint32 sample_filtered(float32 _u, float32 _v, float32 _lod, filter _filter) const;
+        template <layout Layout>
+        static uint32 sample_nearest(const level& _level, float32 _u, float32 _v);
+        template <layout Layout>
+        static uint32 sample_bilinear(const level& _level, float32 _u, float32 _v);
+        template <layout Layout>
+        static int texel_index(const level& _level, int _x, int _y);
+
+        static uint32 lerp_texel(uint32 _a, uint32 _b, uint32 _weight);
+        static int wrap(int _value, int _size);
+
+        std::vector<level> m_levels;
+        layout m_layout = layout::cBlocked;
+    };
+
+    bool texture::load(const char* _path, layout _layout)
+    {
+        SDL_Surface* loaded = IMG_Load(_path);
+        if (!loaded) {
+            std::cerr << "texture: unable to load " << _path << ": " << IMG_GetError() << "\n";
+            return false;
+        }
+
+        SDL_Surface* converted = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_ARGB8888, 0);
+        SDL_FreeSurface(loaded);
+        if (!converted) {
+            std::cerr << "texture: unable to convert " << _path << ": " << SDL_GetError() << "\n";
+            return false;
+        }
+
+        std::vector<uint32> texels(converted->w * converted->h);
+        SDL_LockSurface(converted);
+        for (int y = 0; y < converted->h; ++y) {
+            memcpy(&texels[y * converted->w], (const byte*)converted->pixels + y * converted->pitch, converted->w * sizeof(uint32));
+        }
+        SDL_UnlockSurface(converted);
+
+        bool created = create(converted->w, converted->h, texels.data(), _layout);
+        SDL_FreeSurface(converted);
+        if (!created) {
+            std::cerr << "texture: " << _path << " is empty\n";
+        }
+        return created;
+    }
+
+    bool texture::create(int _width, int _height, const uint32* _texels, layout _layout)
+    {
+        m_levels.clear();
+        if (_width <= 0 || _height <= 0) {
+            return false;
+        }
+
+        m_layout = _layout;
+        m_levels.resize(1);
+        m_levels[0].m_width = _width;
+        m_levels[0].m_height = _height;
+        m_levels[0].m_pitch = _width;
+        m_levels[0].m_texels.assign(_texels, _texels + _width * _height);
+        build_mips();
+
+        // mips are filtered from linear rows, the layout is applied once at the end
+        for (auto& level : m_levels) {
+            convert_level(level);
+        }
+        return true;
+    }
+
+    // pads each level to whole blocks, padding texels repeat the last row and column
+    void texture::convert_level(level& _level) const
+    {
+        if (m_layout == layout::cLinear) {
+            return;
+        }
+
+        int blocksX = (_level.m_width + cBlockSize - 1) >> cBlockBits;
+        int blocksY = (_level.m_height + cBlockSize - 1) >> cBlockBits;
+        texel_storage blocked(blocksX * blocksY * cBlockSize * cBlockSize);
+
+        level result;
+        result.m_width = _level.m_width;
+        result.m_height = _level.m_height;
+        result.m_pitch = blocksX;
+        for (int y = 0; y < blocksY * cBlockSize; ++y) {
+            int sourceY = std::min(y, _level.m_height - 1);
+            for (int x = 0; x < blocksX * cBlockSize; ++x) {
+                int sourceX = std::min(x, _level.m_width - 1);
+                blocked[texel_index<layout::cBlocked>(result, x, y)] = _level.m_texels[sourceY * _level.m_pitch + sourceX];
+            }
+        }
+
+        _level.m_pitch = blocksX;
+        _level.m_texels.swap(blocked);
+    }
+
+    // 2x2 box filter down to 1x1, odd edges repeat their last texel
+    void texture::build_mips()
+    {
+        while (m_levels.back().m_width > 1 || m_levels.back().m_height > 1) {
+            level next;
+            {
+                const level& source = m_levels.back();
+                next.m_width = std::max(source.m_width / 2, 1);
+                next.m_height = std::max(source.m_height / 2, 1);
+                next.m_pitch = next.m_width;
+                next.m_texels.resize(next.m_width * next.m_height);
+
+                for (int y = 0; y < next.m_height; ++y) {
+                    int y0 = std::min(y * 2, source.m_height - 1);
+                    int y1 = std::min(y * 2 + 1, source.m_height - 1);
+                    for (int x = 0; x < next.m_width; ++x) {
+                        int x0 = std::min(x * 2, source.m_width - 1);
+                        int x1 = std::min(x * 2 + 1, source.m_width - 1);
+                        uint32 texels[4] = {
+                            source.m_texels[y0 * source.m_width + x0], source.m_texels[y0 * source.m_width + x1],
+                            source.m_texels[y1 * source.m_width + x0], source.m_texels[y1 * source.m_width + x1],
+                        };
+
+                        uint32 result = 0;
+                        for (int shift = 0; shift < 32; shift += 8) {
+                            uint32 sum = 2;
+                            for (uint32 texel : texels) {
+                                sum += (texel >> shift) & 0xFF;
+                            }
+                            result |= (sum / 4) << shift;
+                        }
+                        next.m_texels[y * next.m_width + x] = result;
+                    }
+                }
+            }
+            m_levels.push_back(std::move(next));
+        }
+    }
+
+    float32 texture::compute_lod(float32 _dudx, float32 _dvdx, float32 _dudy, float32 _dvdy) const
+    {
+        float32 width = (float32)get_width();
+        float32 height = (float32)get_height();
+        float32 x = (_dudx * _dudx) * (width * width) + (_dvdx * _dvdx) * (height * height);
+        float32 y = (_dudy * _dudy) * (width * width) + (_dvdy * _dvdy) * (height * height);
+        float32 footprint = std::max(x, y);
+        return footprint > 0.f ? 0.5f * std::log2(footprint) : 0.f;
+    }
+
+    uint32 texture::sample(float32 _u, float32 _v, float32 _lod, filter _filter) const
+    {
+        if (m_levels.empty()) {
+            return color_pack(color::s_magenta);
+        }
+
+        if (m_layout == layout::cBlocked) {
+            return sample_filtered<layout::cBlocked>(_u, _v, _lod, _filter);
+        }
+        return sample_filtered<layout::cLinear>(_u, _v, _lod, _filter);
+    }
+
+    template <texture::layout Layout>
+    uint32 texture::sample_filtered(float32 _u, float32 _v, float32 _lod, filter _filter) const
+    {
+        int lastLevel = (int)m_levels.size() - 1;
+        float32 lod = math::clamp(_lod, 0.f, (float32)lastLevel);
+
+        switch (_filter) {
+            case filter::cNearest:
+                return sample_nearest<Layout>(m_levels[(int)(lod + 0.5f)], _u, _v);
+
+            case filter::cBilinear:
+                return sample_bilinear<Layout>(m_levels[(int)(lod + 0.5f)], _u, _v);
+
+            default:
+            case filter::cTrilinear:
+                {
+                    int fine = (int)lod;
+                    int coarse = std::min(fine + 1, lastLevel);
+                    uint32 weight = (uint32)((lod - (float32)fine) * 256.f);
+                    uint32 a = sample_bilinear<Layout>(m_levels[fine], _u, _v);
+                    if (weight == 0 || coarse == fine) {
+                        return a;
+                    }
+                    return lerp_texel(a, sample_bilinear<Layout>(m_levels[coarse], _u, _v), weight);
+                }
+        }
+    }
+
+    template <texture::layout Layout>
+    int texture::texel_index(const level& _level, int _x, int _y)
+    {
+        if (Layout == layout::cLinear) {
+            return _y * _level.m_pitch + _x;
+        }
+
+        const int mask = cBlockSize - 1;
+        int block = (_y >> cBlockBits) * _level.m_pitch + (_x >> cBlockBits);
+        return (block << (cBlockBits * 2)) + ((_y & mask) << cBlockBits) + (_x & mask);
+    }
+
+    template <texture::layout Layout>
+    uint32 texture::sample_nearest(const level& _level, float32 _u, float32 _v)
+    {
+        int x = wrap((int)std::floor(_u * _level.m_width), _level.m_width);
+        int y = wrap((int)std::floor(_v * _level.m_height), _level.m_height);
+        return _level.m_texels[texel_index<Layout>(_level, x, y)];
+    }
+
+    // texel centers sit at half coordinates, weights are 8 bit so channels lerp two at a time in one register
+    template <texture::layout Layout>
+    uint32 texture::sample_bilinear(const level& _level, float32 _u, float32 _v)
+    {
+        float32 x = _u * _level.m_width - 0.5f;
+        float32 y = _v * _level.m_height - 0.5f;
+        float32 left = std::floor(x);
+        float32 top = std::floor(y);
+        uint32 weightX = (uint32)((x - left) * 256.f);
+        uint32 weightY = (uint32)((y - top) * 256.f);
+
+        int x0 = wrap((int)left, _level.m_width);
+        int y0 = wrap((int)top, _level.m_height);
+        int x1 = x0 + 1 == _level.m_width ? 0 : x0 + 1;
+        int y1 = y0 + 1 == _level.m_height ? 0 : y0 + 1;
+
+        const uint32* texels = _level.m_texels.data();
+        uint32 topTexel = lerp_texel(texels[texel_index<Layout>(_level, x0, y0)], texels[texel_index<Layout>(_level, x1, y0)], weightX);
+        uint32 bottomTexel = lerp_texel(texels[texel_index<Layout>(_level, x0, y1)], texels[texel_index<Layout>(_level, x1, y1)], weightX);
+        return lerp_texel(topTexel, bottomTexel, weightY);
+    }
+
+    uint32 texture::lerp_texel(uint32 _a, uint32 _b, uint32 _weight)
+    {
+        uint32 inverse = 256 - _weight;
+        uint32 rb = ((_a & 0x00FF00FF) * inverse + (_b & 0x00FF00FF) * _weight) >> 8;
+        uint32 ag = ((_a >> 8) & 0x00FF00FF) * inverse + ((_b >> 8) & 0x00FF00FF) * _weight;
+        return (rb & 0x00FF00FF) | (ag & 0xFF00FF00);
+    }
+
+    int texture::wrap(int _value, int _size)
+    {
+        int result = _value % _size;
+        return result < 0 ? result + _size : result;
+    }
+
+    class device
+    {
+    public:
+        device(int _width, int _height)
+            : m_width(_width), m_height(_height)
+        {
+            reserve(m_width, m_height);
+            resize_tiles();
+
+            if (cpu::has_avx2()) {
+                set_kernel(kernel_type::cAVX2);
+            }
+            else if (cpu::has_sse2()) {
+                set_kernel(kernel_type::cSSE2);
+            }
+            else {
+                set_kernel(kernel_type::cScalar);
+            }
+        }
+
+        enum class buffer_type
+        {
+            cColor,
+            cDepth,
+        };
+
+        static const int cTileSize = 64;
+
+        // hierarchical z keeps a conservative max depth per block, tiles are a whole number of blocks
+        static const int cHiZBlockSize = 8;
+        static const int cHiZBlocksPerTile = cTileSize / cHiZBlockSize;
+        static constexpr float32 cHiZSlack = 1e-6f;
+
+        static const int cOcclusionWidth = 256;
+        static const int cOcclusionHeight = 128;
+
+        // vertices per transform and vertex stage job, a multiple of mesh::cStreamPadding
+        static const int cTransformBatch = 4096;
+
+        // clip space outcodes, the x/y bits test the guard band rather than the viewport
+        static const uint32 cClipNear = 1 << 0;
+        static const uint32 cClipFar = 1 << 1;
+        static const uint32 cClipLeft = 1 << 2;
+        static const uint32 cClipRight = 1 << 3;
+        static const uint32 cClipBottom = 1 << 4;
+        static const uint32 cClipTop = 1 << 5;
+        static const int cClipPlaneCount = 6;
+        static const int cMaxClippedVertices = 3 + cClipPlaneCount;
+
+        // in multiples of w, anything inside skips x/y clipping and is trimmed by the bounding box instead
+        static constexpr float32 cGuardBand = 4.f;
+
+        // vertices snap to 28.4 fixed point, edge values are exact integers in 1/256 pixel squared
+        static const int cSubpixelBits = 4;
+        static const int cSubpixelSize = 1 << cSubpixelBits;
+
+        // keeps every edge step times 8 lanes inside int32, the guard band stays far below this
+        static constexpr float32 cMaxCoordinate = (float32)(1 << 18);
+
+        // a group's int64 edge value is clamped to this before widening to lanes, the sign survives the lane steps
+        static const int32 cEdgeClamp = 1 << 30;
+
+        static const int cMaxVaryings = 8;
+
+        // edge i and depth are planes over pixel centers: value(x, y) = c + b * y + a * x,
+        // edges are integers with the top-left bias folded into c so every kernel tests value >= 0
+        struct triangle
+        {
+            int32 m_edgeA[3], m_edgeB[3];
+            int64 m_edgeC[3];
+            float32 m_zdx, m_zdy, m_zc;
+            float32 m_minZ;
+            int m_minX, m_minY, m_maxX, m_maxY;
+            uint32 m_color;
+
+            // planes for 1/w then every varying divided by w, packed in the frame's varying arena
+            uint32 m_varyingOffset;
+            uint32 m_varyingCount;
+
+            // face index within the mesh, nullptr program means the flat default
+            uint32 m_primitive;
+            const shader_program* m_program;
+            const texture* m_texture;
+        };
+
+        // what a pixel stage sees for one covered pixel, m_color is the stage's own primitive_color
+        struct fragment
+        {
+            int m_x, m_y;
+            float32 m_z;
+            float32 m_w;
+            uint32 m_primitive;
+            uint32 m_color;
+            const float32* m_varyings;
+            const float32* m_planes;
+            const texture* m_texture;
+
+            // screen space derivatives of a varying, exact from its attribute/w and 1/w planes
+            float32 ddx(int _varying) const { return (m_planes[(_varying + 1) * 3] - m_varyings[_varying] * m_planes[0]) * m_w; }
+            float32 ddy(int _varying) const { return (m_planes[(_varying + 1) * 3 + 1] - m_varyings[_varying] * m_planes[1]) * m_w; }
+        };
+
+        // the vertex weights as planes over pixel centers, in the order the vertices were passed to setup
+        struct barycentrics
+        {
+            float64 m_a[3], m_b[3], m_c[3];
+        };
+
+        struct raster_target
+        {
+            uint32* m_color;
+            float32* m_depth;
+            int m_pitch;
+            const float32* m_varyings;
+        };
+
+        struct clip_vertex
+        {
+            glm::vec4 m_position;
+            float32 m_varyings[cMaxVaryings];
+        };
+
+        // post transform cache in the same padded layout as the mesh streams, screen positions are only valid when guard is 0
+        struct vertex_cache
+        {
+            std::vector<float32> m_clipX, m_clipY, m_clipZ, m_clipW;
+            std::vector<float32> m_screenX, m_screenY, m_screenZ;
+            std::vector<uint32> m_outside, m_guard;
+
+            void reserve(size_t _count);
+        };
+
+        // kernels transform vertices [_begin, _end), both multiples of mesh::cStreamPadding or the padded stream end
+        typedef void (*transform_kernel)(const mesh&, const glm::mat4&, float32, float32, vertex_cache&, size_t, size_t);
+
+        // kernels return how many pixels they wrote
+        typedef uint32 (*raster_kernel)(const triangle&, const raster_target&, int, int, int, int);
+
+        // reset by clear, accumulated by every render call in between
+        struct render_stats
+        {
+            uint64 m_meshesCulled = 0;
+            uint64 m_meshesOccluded = 0;
+            uint64 m_vertices = 0;
+            uint64 m_triangles = 0;
+            uint64 m_trianglesRasterized = 0;
+            uint64 m_trianglesClipped = 0;
+            uint64 m_trianglesCulled = 0;
+            uint64 m_pixels = 0;
+            uint64 m_blocksRejected = 0;
+            float64 m_transformMs = 0.0;
+            float64 m_rasterizeMs = 0.0;
+        };
+
+        // winding as seen in normalized device coordinates (y up), so counter clockwise meshes cull cClockwise
+        enum class cull_mode
+        {
+            cNone,
+            cClockwise,
+            cCounterClockwise,
+        };
+
+        enum class kernel_type
+        {
+            cScalar,
+            cSSE2,
+            cAVX2,
+        };
+
+        // sizes up to the reserved capacity keep the allocation and pitch, so changing resolution only costs a clear
+        void resize(int _width, int _height);
+        // grows the capacity to hold _width x _height, the contents are lost when it does
+        void reserve(int _width, int _height);
+        // reallocates both buffers with the new page mode, the contents are lost
+        void set_page_mode(memory::page_mode _mode);
+        memory::page_mode get_page_mode() const { return m_pageMode; }
+        void clear(uint32 _value = 0xFF000000);
+        void resolve();
+        // writes the clear color of every pending tile into the color target only, depth and the pending flags are
+        // left as they are, so a frame can be handed out without paying for a full clear
+        void fill_pending_colors();
+        // false without touching _destination while the frame is handed off, see hand_off_color_target
+        bool copy_colors(uint32* _destination, int _pitch) const;
+        void clear_rect(int _x, int _y, int _width, int _height, uint32 _value = 0xFF000000);
+        void clear_tiles(const int* _tiles, int _count, uint32 _value = 0xFF000000);
+        void poke(int _index, uint32 _value);
+        void put_pixel(int _x, int _y, float32 _depth, const color& _color);
+        void draw_point(const glm::vec3& _position, const color& _color);
+        void draw_line(const glm::vec3& _start, const glm::vec3& _end, const color& _color);
+        void draw_triangle(const glm::vec3& _v1, const glm::vec3& _v2, const glm::vec3& _v3, const color& _color);
+        bool setup_triangle(const glm::vec3& _v1, const glm::vec3& _v2, const glm::vec3& _v3, const color& _color, triangle& _triangle, barycentrics* _barycentrics = nullptr);
+        uint32 rasterize_triangle(const triangle& _triangle, int _minX, int _minY, int _maxX, int _maxY);
+        glm::vec3 project(const glm::vec3& _position, const glm::mat4& _translationMatrix);
+        glm::vec3 project(const glm::vec4& _clip) const;
+        static glm::vec3 project(const glm::vec4& _clip, float32 _width, float32 _height);
+
+        void set_cull_mode(cull_mode _mode) { m_cullMode = _mode; }
+        cull_mode get_cull_mode() const { return m_cullMode; }
+
+        void set_kernel(kernel_type _kernel);
+        kernel_type get_kernel() const { return m_kernelType; }
+        const render_stats& get_stats() const { return m_stats; }
+        int get_thread_count() const { return m_scheduler->get_thread_count(); }
+
+        // pending tiles hold stale memory until resolve, use copy_colors to read a frame without it.
+        // nullptr while the frame is handed off
+        uint32* get_colors() const { return m_colorsHandedOff ? nullptr : m_buffer; }
+
+        // renders into _colors, which holds get_pitch() * get_height() pixels, until the next call. nullptr goes back to
+        // the device's own buffer. switch before clear, tiles resolved earlier in the frame stay in the previous buffer
+        void set_color_target(uint32* _colors) { m_buffer = _colors ? _colors : m_colorStorage.data(); }
+        // gives the finished frame in the attached target away and goes back to the device's own buffer, which does
+        // not hold that frame. colors cannot be read until the next clear starts a new frame
+        void hand_off_color_target();
+        int get_width() const { return m_width; }
+        // pixels from one row to the next in both buffers, at least get_width()
+        int get_pitch() const { return m_pitch; }
+        int get_height() const { return m_height; }
+        int get_size() const { return m_width * m_height; }
+
+        // cColor gives nullptr while the frame is handed off
+        SDL_Surface* create_surface(buffer_type _bufferType = buffer_type::cColor);
+
+        int index_from_xy(int _x, int _y) const
+        {
+            if (_x < 0 || _x >= m_width || _y < 0 || _y >= m_height) {
+                return -1;
+            }
+            return m_pitch * _y + _x;
+        }
+
+        void xy_from_index(int _index, int& _x, int& _y) const
+        {
+            _x = _index % m_pitch;
+            _y = _index / m_pitch;
+        }
+
+        // geometry and rasterization run on separate bin sets, so prepare for one frame may overlap
+        // rasterize of another as long as each set is used by one of them at a time
+        static const int cBinSetCount = 2;
+
+        void render(const camera& _camera, mesh* _meshes, int _meshCount);
+        void prepare(const camera& _camera, mesh* _meshes, int _meshCount, int _set);
+        void rasterize(int _set);
+
+        // one program per stage pair, its raster kernel is the pixel stage's own instantiation
+        template <class VertexStage, class PixelStage>
+        static const shader_program* get_program();
+        static const shader_program* get_default_program();
+
+    private:
+        static void transform_scalar(const mesh& _mesh, const glm::mat4& _matrix, float32 _width, float32 _height, vertex_cache& _cache, size_t _begin, size_t _end);
+#if defined(SOFT_SIMD)
+        static void transform_sse2(const mesh& _mesh, const glm::mat4& _matrix, float32 _width, float32 _height, vertex_cache& _cache, size_t _begin, size_t _end);
+        SOFT_TARGET_AVX2 static void transform_avx2(const mesh& _mesh, const glm::mat4& _matrix, float32 _width, float32 _height, vertex_cache& _cache, size_t _begin, size_t _end);
+#endif
+
+        static uint32 rasterize_scalar(const triangle& _triangle, const raster_target& _target, int _minX, int _minY, int _maxX, int _maxY);
+        template <class PixelStage>
+        static raster_kernel select_raster(std::true_type) { return nullptr; }
+        template <class PixelStage>
+        static raster_kernel select_raster(std::false_type) { return &rasterize_shaded<PixelStage>; }
+        template <class PixelStage>
+        static uint32 rasterize_shaded(const triangle& _triangle, const raster_target& _target, int _minX, int _minY, int _maxX, int _maxY);
+#if defined(SOFT_SIMD)
+        static uint32 rasterize_sse2(const triangle& _triangle, const raster_target& _target, int _minX, int _minY, int _maxX, int _maxY);
+        SOFT_TARGET_AVX2 static uint32 rasterize_avx2(const triangle& _triangle, const raster_target& _target, int _minX, int _minY, int _maxX, int _maxY);
+#endif
+
+        void allocate_buffers();
+        void resize_tiles();
+        void fill_rect(int _x, int _y, int _width, int _height, uint32 _value, bool _streaming);
+        void resolve_tile(int _tile);
+        void resolve_rect(int _minX, int _minY, int _maxX, int _maxY);
+        enum class setup_result
+        {
+            cAccepted,
+            cCulled,
+            cOutside,
+        };
+
+        static int32 clamp_edge(int64 _value);
+        static setup_result setup_planes(const glm::vec3& _v1, const glm::vec3& _v2, const glm::vec3& _v3, int _width, int _height, cull_mode _cullMode, triangle& _triangle, barycentrics* _barycentrics = nullptr);
+        static void world_bounds(const mesh& _mesh, const glm::mat4& _worldMatrix, glm::vec3& _min, glm::vec3& _max);
+        static bool is_visible(const mesh& _mesh, const glm::mat4& _worldMatrix, const frustum& _frustum);
+        void draw_occluder(const mesh& _mesh, const glm::mat4& _transformMatrix);
+        bool is_occluded(const mesh& _mesh, const glm::mat4& _transformMatrix) const;
+        static void classify(const glm::vec4& _clip, uint32& _outside, uint32& _guard);
+        static int clip_polygon(const clip_vertex* _input, int _count, int _varyingCount, uint32 _planes, clip_vertex* _output);
+        // what prepare hands to rasterize for one frame, m_stats holds the geometry counters
+        struct bin_set
+        {
+            std::vector<triangle> m_triangles;
+            std::vector<float32> m_varyings;
+            std::vector<std::vector<uint32>> m_bins;
+            render_stats m_stats;
+        };
+
+        void transform_vertices(const mesh& _mesh, const glm::mat4& _transformMatrix, render_stats& _stats);
+        void submit_triangle(bin_set& _set, const glm::vec3* _screen, const float32* _invW, const float32* const* _varyings, const color& _color, uint32 _primitive, const shader_program* _program, const texture* _texture);
+        void bin_triangle(bin_set& _set, uint32 _index);
+        void rasterize_tile(bin_set& _set, int _tile);
+        static bool covers_block(const triangle& _triangle, int _minX, int _minY, int _maxX, int _maxY, float32& _maxZ);
+
+        // rows start on cSurfaceAlignment boundaries
+        static const int cPitchAlignment = (int)(memory::cSurfaceAlignment / sizeof(uint32));
+
+        int m_width = 0;
+        int m_height = 0;
+        int m_pitch = 0;
+        int m_rows = 0;
+        uint32* m_buffer = nullptr;
+        float32* m_depthBuffer = nullptr;
+        memory::surface_buffer<uint32> m_colorStorage;
+        memory::surface_buffer<float32> m_depthStorage;
+        memory::page_mode m_pageMode = memory::page_mode::cTransparentHuge;
+
+        cull_mode m_cullMode = cull_mode::cNone;
+        kernel_type m_kernelType = kernel_type::cScalar;
+        raster_kernel m_rasterKernel = nullptr;
+        transform_kernel m_transformKernel = nullptr;
+
+        int m_tilesX = 0;
+        int m_tilesY = 0;
+        vertex_cache m_vertexCache;
+        bin_set m_binSets[cBinSetCount];
+        std::vector<float32> m_vertexVaryings;
+        std::vector<std::pair<float32, int>> m_drawOrder;
+        vertex_cache m_occlusionCache;
+        std::vector<float32> m_occlusionDepth;
+        std::vector<uint32> m_occlusionColor;
+        std::vector<uint64> m_tilePixels;
+        std::vector<uint64> m_tileBlocksRejected;
+        std::vector<float32> m_hiZ;
+        int m_hiZPitch = 0;
+        std::vector<uint8> m_tilePending;
+        std::vector<uint32> m_tileClearColor;
+        bool m_colorsHandedOff = false;
+        render_stats m_stats;
+        jobs::scheduler* m_scheduler = &jobs::scheduler::get_default();
+    };
+
+    struct shader_program
+    {
+        int m_varyingCount;
+        bool m_depthTest;
+        bool m_depthWrite;
+        // writes one vertex's varyings, positions never pass through it
+        void (*m_vertex)(const mesh&, uint32, float32*);
+        color (*m_primitiveColor)(uint32);
+
+        // nullptr uses the device's simd flat kernel
+        device::raster_kernel m_raster;
+    };
+
+    // vertex stages write cOutputCount varyings per vertex, pixel stages shade one covered pixel;
+    // the flags are compile time so every pixel stage gets an inner loop with the unused work folded away.
+    // positions always go through the device's transform kernels, a vertex stage cannot move or deform vertices.
+    // cFlat stages are drawn by the device's simd flat kernels with primitive_color, so they must test and write
+    // depth, read no varyings and have no shade; get_program rejects any that do
+    template <class T, class = void>
+    struct has_shade : std::false_type {};
+
+    template <class T>
+    struct has_shade<T, decltype((void)&T::shade)> : std::true_type {};
+
+    struct no_varyings
+    {
+        static const int cOutputCount = 0;
+
+        static void process(const mesh&, uint32, float32*) {}
+    };
+
+    template <int Count>
+    struct mesh_varyings
+    {
+        static const int cOutputCount = Count;
+
+        static void process(const mesh& _mesh, uint32 _vertex, float32* _output)
+        {
+            for (int i = 0; i < Count; ++i) {
+                _output[i] = i < _mesh.m_varyingCount ? _mesh.m_varyings[_vertex * _mesh.m_varyingCount + i] : 0.f;
+            }
+        }
+    };
+
+    // alternating per-face colors, flat so it keeps the simd kernels
+    struct face_colors
+    {
+        static const int cVaryingCount = 0;
+        static const bool cFlat = true;
+        static const bool cDepthTest = true;
+        static const bool cDepthWrite = true;
+
+        static color primitive_color(uint32 _primitive) { return _primitive % 2 == 0 ? color::s_yellow : color::s_cyan; }
+    };
+
+    // varyings 0..2 as rgb
+    struct vertex_colors
+    {
+        static const int cVaryingCount = 3;
+        static const bool cFlat = false;
+        static const bool cDepthTest = true;
+        static const bool cDepthWrite = true;
+
+        static color primitive_color(uint32) { return color::s_white; }
+
+        static uint32 shade(const device::fragment& _fragment)
+        {
+            return 0xFF000000 |
+                (uint32)(math::clamp(_fragment.m_varyings[0]) * 255.f) << 16 |
+                (uint32)(math::clamp(_fragment.m_varyings[1]) * 255.f) << 8 |
+                (uint32)(math::clamp(_fragment.m_varyings[2]) * 255.f);
+        }
+    };
+
+    // varyings 0..1 as uv into the mesh's texture, the mip level follows the uv footprint of the pixel. meshes
+    // without a texture come out magenta
+    template <texture::filter Filter>
+    struct textured
+    {
+        static const int cVaryingCount = 2;
+        static const bool cFlat = false;
+        static const bool cDepthTest = true;
+        static const bool cDepthWrite = true;
+
+        static color primitive_color(uint32) { return color::s_white; }
+
+        static uint32 shade(const device::fragment& _fragment)
+        {
+            if (!_fragment.m_texture) {
+                return color_pack(color::s_magenta);
+            }
+
+            float32 u = _fragment.m_varyings[0];
+            float32 v = _fragment.m_varyings[1];
+            float32 lod = _fragment.m_texture->compute_lod(_fragment.ddx(0), _fragment.ddx(1), _fragment.ddy(0), _fragment.ddy(1));
+            return _fragment.m_texture->sample(u, v, lod, Filter) | 0xFF000000;
+        }
+    };
+
+    template <class VertexStage, class PixelStage>
+    const shader_program* device::get_program()
+    {
+        static_assert(VertexStage::cOutputCount == PixelStage::cVaryingCount, "the vertex stage must write every varying the pixel stage reads");
+        static_assert(PixelStage::cVaryingCount <= cMaxVaryings, "too many varyings");
+        static_assert(!PixelStage::cFlat || (PixelStage::cVaryingCount == 0 && PixelStage::cDepthTest && PixelStage::cDepthWrite),
+            "flat pixel stages run on the fixed-function kernels, which always test and write depth");
+        static_assert(PixelStage::cFlat != has_shade<PixelStage>::value, "flat pixel stages cannot shade, every other stage must");
+
+        static const shader_program s_program = {
+            PixelStage::cVaryingCount,
+            PixelStage::cDepthTest,
+            PixelStage::cDepthWrite,
+            &VertexStage::process,
+            &PixelStage::primitive_color,
+            select_raster<PixelStage>(std::integral_constant<bool, PixelStage::cFlat>()),
+        };
+        return &s_program;
+    }
+
+    const shader_program* device::get_default_program()
+    {
+        return get_program<no_varyings, face_colors>();
+    }
+
+    const int device::cTileSize;
+    const int device::cMaxVaryings;
+    constexpr float32 device::cGuardBand;
+    constexpr float32 device::cMaxCoordinate;
+    constexpr float32 device::cHiZSlack;
+
+    void device::resize(int _width, int _height)
+    {
+        m_width = _width;
+        m_height = _height;
+
+        // an attached color target has the old size and pitch
+        reserve(m_width, m_height);
+        m_buffer = m_colorStorage.data();
+
+        resize_tiles();
+        clear();
+    }
+
+    // capacity only grows, its pitch and row count are the largest ever asked for
+    void device::reserve(int _width, int _height)
+    {
+        int pitch = std::max(m_pitch, (_width + cPitchAlignment - 1) / cPitchAlignment * cPitchAlignment);
+        int rows = std::max(m_rows, _height);
+        if (pitch == m_pitch && rows == m_rows) {
+            return;
+        }
+
+        m_pitch = pitch;
+        m_rows = rows;
+        allocate_buffers();
+    }
+
+    void device::allocate_buffers()
+    {
+        m_colorStorage.resize(m_pitch * m_rows, m_pageMode);
+        m_depthStorage.resize(m_pitch * m_rows, m_pageMode);
+        m_buffer = m_colorStorage.data();
+        m_depthBuffer = m_depthStorage.data();
+    }
+
+    void device::set_page_mode(memory::page_mode _mode)
+    {
+        if (_mode == m_pageMode) {
+            return;
+        }
+
+        m_pageMode = _mode;
+        m_colorStorage.release();
+        m_depthStorage.release();
+        allocate_buffers();
+        clear();
+    }
+
+    void device::resize_tiles()
+    {
+        m_tilesX = (m_width + cTileSize - 1) / cTileSize;
+        m_tilesY = (m_height + cTileSize - 1) / cTileSize;
+        for (auto& set : m_binSets) {
+            set.m_bins.resize(m_tilesX * m_tilesY);
+        }
+        m_tilePixels.assign(m_tilesX * m_tilesY, 0);
+        m_tileBlocksRejected.assign(m_tilesX * m_tilesY, 0);
+        m_hiZPitch = m_tilesX * cHiZBlocksPerTile;
+        m_hiZ.assign(m_hiZPitch * m_tilesY * cHiZBlocksPerTile, std::numeric_limits<float32>::max());
+        m_tilePending.assign(m_tilesX * m_tilesY, 0);
+        m_tileClearColor.assign(m_tilesX * m_tilesY, 0);
+    }
+
+    void device::set_kernel(kernel_type _kernel)
+    {
+        switch (_kernel) {
+#if defined(SOFT_SIMD)
+            case kernel_type::cAVX2:
+                if (cpu::has_avx2()) {
+                    m_kernelType = kernel_type::cAVX2;
+                    m_rasterKernel = &device::rasterize_avx2;
+                    m_transformKernel = &device::transform_avx2;
+                    return;
+                }
+                // fall through
+            case kernel_type::cSSE2:
+                m_kernelType = kernel_type::cSSE2;
+                m_rasterKernel = &device::rasterize_sse2;
+                m_transformKernel = &device::transform_sse2;
+                return;
+#endif
+            default:
+                m_kernelType = kernel_type::cScalar;
+                m_rasterKernel = &device::rasterize_scalar;
+                m_transformKernel = &device::transform_scalar;
+                return;
+        }
+    }
+
+    void device::clear(uint32 _value /* = 0xFF000000 */)
+    {
+        m_stats = render_stats();
+
+        // only marks the tiles, the first raster or pixel write to a tile fills it
+        std::fill(m_tilePending.begin(), m_tilePending.end(), (uint8)1);
+        std::fill(m_tileClearColor.begin(), m_tileClearColor.end(), _value);
+        m_colorsHandedOff = false;
+    }
+
+    void device::hand_off_color_target()
+    {
+        m_buffer = m_colorStorage.data();
+        m_colorsHandedOff = true;
+    }
+
+    // nothing is drawn after a whole-surface resolve, so it streams instead of going through resolve_tile
+    void device::resolve()
+    {
+        m_scheduler->parallel_for(m_tilesX * m_tilesY, [this](int _tile) {
+            if (!m_tilePending[_tile]) {
+                return;
+            }
+
+            fill_rect((_tile % m_tilesX) * cTileSize, (_tile / m_tilesX) * cTileSize, cTileSize, cTileSize, m_tileClearColor[_tile], true);
+            memory::stream_fence();
+            m_tilePending[_tile] = 0;
+        });
+    }
+
+    void device::fill_pending_colors()
+    {
+        m_scheduler->parallel_for(m_tilesX * m_tilesY, [this](int _tile) {
+            if (!m_tilePending[_tile]) {
+                return;
+            }
+
+            int minX = (_tile % m_tilesX) * cTileSize;
+            int minY = (_tile / m_tilesX) * cTileSize;
+            size_t count = std::min(minX + cTileSize, m_width) - minX;
+            int maxY = std::min(minY + cTileSize, m_height);
+            for (int y = minY; y < maxY; ++y) {
+                memory::fill_streaming(m_buffer + y * m_pitch + minX, count, m_tileClearColor[_tile]);
+            }
+            memory::stream_fence();
+        });
+    }
+
+    // pending tiles are written straight from their clear value, so untouched tiles never read the buffer
+    bool device::copy_colors(uint32* _destination, int _pitch) const
+    {
+        if (m_colorsHandedOff) {
+            return false;
+        }
+
+        for (int y = 0; y < m_height; ++y) {
+            const uint32* source = m_buffer + y * m_pitch;
+            uint32* destination = _destination + y * _pitch;
+            int tileRow = (y / cTileSize) * m_tilesX;
+
+            for (int tx = 0; tx < m_tilesX; ++tx) {
+                int minX = tx * cTileSize;
+                int count = std::min(cTileSize, m_width - minX);
+                if (m_tilePending[tileRow + tx]) {
+                    std::fill_n(destination + minX, count, m_tileClearColor[tileRow + tx]);
+                }
+                else {
+                    memcpy(destination + minX, source + minX, count * sizeof(uint32));
+                }
+            }
+        }
+        return true;
+    }
+
+    void device::clear_rect(int _x, int _y, int _width, int _height, uint32 _value /* = 0xFF000000 */)
+    {
+        // partially covered tiles must be resolved first or their pending clear would win later
+        resolve_rect(_x, _y, _x + _width - 1, _y + _height - 1);
+        fill_rect(_x, _y, _width, _height, _value, true);
+        memory::stream_fence();
+    }
+
+    void device::clear_tiles(const int* _tiles, int _count, uint32 _value /* = 0xFF000000 */)
+    {
+        for (int i = 0; i < _count; ++i) {
+            int tile = _tiles[i];
+            if (tile < 0 || tile >= m_tilesX * m_tilesY) {
+                continue;
+            }
+            m_tilePending[tile] = 1;
+            m_tileClearColor[tile] = _value;
+        }
+    }
+
+    // the tile is drawn right after, so cached stores leave its color and depth lines where the raster kernel wants them
+    void device::resolve_tile(int _tile)
+    {
+        if (!m_tilePending[_tile]) {
+            return;
+        }
+
+        fill_rect((_tile % m_tilesX) * cTileSize, (_tile / m_tilesX) * cTileSize, cTileSize, cTileSize, m_tileClearColor[_tile], false);
+        m_tilePending[_tile] = 0;
+    }
+
+    void device::resolve_rect(int _minX, int _minY, int _maxX, int _maxY)
+    {
+        int tileMinX = std::max(_minX, 0) / cTileSize;
+        int tileMinY = std::max(_minY, 0) / cTileSize;
+        int tileMaxX = std::min(_maxX, m_width - 1) / cTileSize;
+        int tileMaxY = std::min(_maxY, m_height - 1) / cTileSize;
+
+        for (int ty = tileMinY; ty <= tileMaxY; ++ty) {
+            for (int tx = tileMinX; tx <= tileMaxX; ++tx) {
+                resolve_tile(ty * m_tilesX + tx);
+            }
+        }
+    }
+
+    // _streaming bypasses the cache, the caller fences before anyone else reads the rect
+    void device::fill_rect(int _x, int _y, int _width, int _height, uint32 _value, bool _streaming)
+    {
+        int minX = std::max(_x, 0);
+        int minY = std::max(_y, 0);
+        int maxX = std::min(_x + _width, m_width);
+        int maxY = std::min(_y + _height, m_height);
+        if (minX >= maxX || minY >= maxY) {
+            return;
+        }
+
+        size_t count = maxX - minX;
+        float32 farDepth = std::numeric_limits<float32>::max();
+        for (int y = minY; y < maxY; ++y) {
+            if (_streaming) {
+                memory::fill_streaming(m_buffer + y * m_pitch + minX, count, _value);
+                memory::fill_streaming(m_depthBuffer + y * m_pitch + minX, count, farDepth);
+            }
+            else {
+                std::fill_n(m_buffer + y * m_pitch + minX, count, _value);
+                std::fill_n(m_depthBuffer + y * m_pitch + minX, count, farDepth);
+            }
+        }
+
+        // partially cleared blocks are reset too, a too large max is still conservative
+        for (int by = minY / cHiZBlockSize; by <= (maxY - 1) / cHiZBlockSize; ++by) {
+            for (int bx = minX / cHiZBlockSize; bx <= (maxX - 1) / cHiZBlockSize; ++bx) {
+                m_hiZ[by * m_hiZPitch + bx] = std::numeric_limits<float32>::max();
+            }
+        }
+    }
+
+    void device::poke(int _index, uint32 _value)
+    {
+        int x, y;
+        xy_from_index(_index, x, y);
+        resolve_tile((y / cTileSize) * m_tilesX + x / cTileSize);
+        m_buffer[_index] = _value;
+    }
+
+    void device::put_pixel(int _x, int _y, float32 _depth, const color& _color)
+    {
+        int index = index_from_xy(_x, _y);
+        if (index < 0) {
+            return;
+        }
+
+        resolve_tile((_y / cTileSize) * m_tilesX + _x / cTileSize);
+        if (m_depthBuffer[index] < _depth) {
+            return;
+        }
+
+        m_depthBuffer[index] = _depth;
+        poke(index, color_pack(_color));
+    }
+
+    void device::draw_point(const glm::vec3& _position, const color& _color)
+    {
+        put_pixel((int)_position.x, (int)_position.y, _position.z, _color);
+    }
+
+    void device::draw_line(const glm::vec3& _start, const glm::vec3& _end, const color& _color)
+    {
+        glm::ivec3 start(_start);
+        glm::ivec3 end(_end);
+
+        auto delta = glm::abs(end - start);
+        auto sx = (start.x < end.x) ? 1 : -1;
+        auto sy = (start.y < end.y) ? 1 : -1;
+        auto err = delta.x - delta.y;
+
+        glm::ivec3 current = start;
+
+        while (true) {
+            draw_point(glm::vec3(current), _color);
+
+            if (current == end) {
+                break;
+            }
+
+            auto e2 = err * 2;
+
+            if (e2 > -delta.y) {
+                err -= delta.y;
+                current.x += sx;
+            }
+
+            if (e2 < delta.x) {
+                err += delta.x;
+                current.y += sy;
+            }
+        }
+    }
+
+    void device::draw_triangle(const glm::vec3& _v1, const glm::vec3& _v2, const glm::vec3& _v3, const color& _color)
+    {
+        triangle tri;
+        if (setup_triangle(_v1, _v2, _v3, _color, tri)) {
+            rasterize_triangle(tri, tri.m_minX, tri.m_minY, tri.m_maxX, tri.m_maxY);
+        }
+    }
+
+    bool device::setup_triangle(const glm::vec3& _v1, const glm::vec3& _v2, const glm::vec3& _v3, const color& _color, triangle& _triangle, barycentrics* _barycentrics /* = nullptr */)
+    {
+        setup_result result = setup_planes(_v1, _v2, _v3, m_width, m_height, m_cullMode, _triangle, _barycentrics);
+        if (result == setup_result::cCulled) {
+            ++m_stats.m_trianglesCulled;
+        }
+        if (result != setup_result::cAccepted) {
+            return false;
+        }
+
+        _triangle.m_color = color_pack(_color);
+        _triangle.m_varyingOffset = 0;
+        _triangle.m_varyingCount = 0;
+        _triangle.m_primitive = 0;
+        _triangle.m_program = nullptr;
+        _triangle.m_texture = nullptr;
+        return true;
+    }
+
+    device::setup_result device::setup_planes(const glm::vec3& _v1, const glm::vec3& _v2, const glm::vec3& _v3, int _width, int _height, cull_mode _cullMode, triangle& _triangle, barycentrics* _barycentrics /* = nullptr */)
+    {
+        const glm::vec3* verts[3] = { &_v1, &_v2, &_v3 };
+        int order[3] = { 0, 1, 2 };
+        int64 x[3], y[3];
+        for (int i = 0; i < 3; ++i) {
+            // NaN fails the range test too
+            if (!(std::abs(verts[i]->x) <= cMaxCoordinate && std::abs(verts[i]->y) <= cMaxCoordinate)) {
+                return setup_result::cCulled;
+            }
+            x[i] = (int64)std::floor(verts[i]->x * cSubpixelSize + 0.5f);
+            y[i] = (int64)std::floor(verts[i]->y * cSubpixelSize + 0.5f);
+        }
+
+        // screen y points down, so positive area is clockwise in ndc
+        int64 area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+        bool culled = area == 0 ||
+            (area > 0 && _cullMode == cull_mode::cClockwise) ||
+            (area < 0 && _cullMode == cull_mode::cCounterClockwise);
+        if (culled) {
+            return setup_result::cCulled;
+        }
+
+        if (area < 0) {
+            std::swap(x[1], x[2]);
+            std::swap(y[1], y[2]);
+            std::swap(verts[1], verts[2]);
+            std::swap(order[1], order[2]);
+            area = -area;
+        }
+
+        int64 minx = std::min({ x[0], x[1], x[2] });
+        int64 maxx = std::max({ x[0], x[1], x[2] });
+        int64 miny = std::min({ y[0], y[1], y[2] });
+        int64 maxy = std::max({ y[0], y[1], y[2] });
+
+        if (maxx < 0 || maxy < 0 || minx >= (int64)_width * cSubpixelSize || miny >= (int64)_height * cSubpixelSize) {
+            return setup_result::cOutside;
+        }
+
+        // the range of pixel centers inside the bounds, empty for slivers that fall between them
+        const int64 half = cSubpixelSize / 2;
+        int64 left = (minx - half + cSubpixelSize - 1) >> cSubpixelBits;
+        int64 right = (maxx - half) >> cSubpixelBits;
+        int64 top = (miny - half + cSubpixelSize - 1) >> cSubpixelBits;
+        int64 bottom = (maxy - half) >> cSubpixelBits;
+        if (left > right || top > bottom) {
+            return setup_result::cCulled;
+        }
+
+        _triangle.m_minX = (int)std::max<int64>(left, 0);
+        _triangle.m_maxX = (int)std::min<int64>(right, _width - 1);
+        _triangle.m_minY = (int)std::max<int64>(top, 0);
+        _triangle.m_maxY = (int)std::min<int64>(bottom, _height - 1);
+        if (_triangle.m_minX > _triangle.m_maxX || _triangle.m_minY > _triangle.m_maxY) {
+            return setup_result::cOutside;
+        }
+
+        // edge i is opposite vertex i, evaluated relative to pixel (0, 0)'s center
+        float64 zc = 0.0, zdx = 0.0, zdy = 0.0;
+        for (int i = 0; i < 3; ++i) {
+            int from = (i + 1) % 3;
+            int to = (i + 2) % 3;
+            int64 a = y[from] - y[to];
+            int64 b = x[to] - x[from];
+            int64 c = b * (half - y[from]) + a * (half - x[from]);
+
+            _triangle.m_edgeA[i] = (int32)(a * cSubpixelSize);
+            _triangle.m_edgeB[i] = (int32)(b * cSubpixelSize);
+
+            // top-left rule: the inside gradient points right on a left edge and down on a top edge,
+            // any other edge drops the pixels sitting exactly on it so shared edges are covered once
+            bool topLeft = a > 0 || (a == 0 && b > 0);
+            _triangle.m_edgeC[i] = topLeft ? c : c - 1;
+
+            float64 z = verts[i]->z;
+            zdx += (float64)_triangle.m_edgeA[i] * z;
+            zdy += (float64)_triangle.m_edgeB[i] * z;
+            zc += (float64)c * z;
+
+            if (_barycentrics) {
+                _barycentrics->m_a[order[i]] = (float64)_triangle.m_edgeA[i] / area;
+                _barycentrics->m_b[order[i]] = (float64)_triangle.m_edgeB[i] / area;
+                _barycentrics->m_c[order[i]] = (float64)c / area;
+            }
+        }
+
+        _triangle.m_zdx = (float32)(zdx / area);
+        _triangle.m_zdy = (float32)(zdy / area);
+        _triangle.m_zc = (float32)(zc / area);
+        _triangle.m_minZ = std::min({ _v1.z, _v2.z, _v3.z }) - cHiZSlack;
+        return setup_result::cAccepted;
+    }
+
+    uint32 device::rasterize_triangle(const triangle& _triangle, int _minX, int _minY, int _maxX, int _maxY)
+    {
+        resolve_rect(_minX, _minY, _maxX, _maxY);
+        raster_target target = { m_buffer, m_depthBuffer, m_pitch, nullptr };
+        raster_kernel kernel = _triangle.m_program && _triangle.m_program->m_raster ? _triangle.m_program->m_raster : m_rasterKernel;
+        return kernel(_triangle, target, _minX, _minY, _maxX, _maxY);
+    }
+
+    int32 device::clamp_edge(int64 _value)
+    {
+        return (int32)std::min<int64>(std::max<int64>(_value, -cEdgeClamp), cEdgeClamp);
+    }
+
+    // edges are exact integers so coverage never depends on the kernel, depth is evaluated as (c + b * y) + a * x everywhere
+    uint32 device::rasterize_scalar(const triangle& _triangle, const raster_target& _target, int _minX, int _minY, int _maxX, int _maxY)
+    {
+        const int32* a = _triangle.m_edgeA;
+        const int32* b = _triangle.m_edgeB;
+        const int64* c = _triangle.m_edgeC;
+        uint32 written = 0;
+
+        for (int y = _minY; y <= _maxY; ++y) {
+            uint32* colorRow = _target.m_color + y * _target.m_pitch;
+            float32* depthRow = _target.m_depth + y * _target.m_pitch;
+
+            int64 w0Row = c[0] + (int64)b[0] * y;
+            int64 w1Row = c[1] + (int64)b[1] * y;
+            int64 w2Row = c[2] + (int64)b[2] * y;
+
+            float32 fy = (float32)y;
+            float32 zRow = _triangle.m_zc + _triangle.m_zdy * fy;
+
+            for (int x = _minX; x <= _maxX; ++x) {
+                int64 w0 = w0Row + (int64)a[0] * x;
+                int64 w1 = w1Row + (int64)a[1] * x;
+                int64 w2 = w2Row + (int64)a[2] * x;
+                float32 z = zRow + _triangle.m_zdx * (float32)x;
+
+                if ((w0 | w1 | w2) >= 0 && z <= depthRow[x]) {
+                    depthRow[x] = z;
+                    colorRow[x] = _triangle.m_color;
+                    ++written;
+                }
+            }
+        }
+
+        return written;
+    }
+
+    // one reciprocal per pixel recovers w and every varying is then a multiply, the stage's flags are constants
+    template <class PixelStage>
+    uint32 device::rasterize_shaded(const triangle& _triangle, const raster_target& _target, int _minX, int _minY, int _maxX, int _maxY)
+    {
+        const int cPlaneCount = 1 + PixelStage::cVaryingCount;
+
+        const int32* a = _triangle.m_edgeA;
+        const int32* b = _triangle.m_edgeB;
+        const int64* c = _triangle.m_edgeC;
+        const float32* planes = _target.m_varyings + _triangle.m_varyingOffset;
+        uint32 written = 0;
+
+        float32 values[cPlaneCount];
+        float32 rowBase[cPlaneCount];
+
+        fragment input;
+        input.m_w = 1.f;
+        input.m_primitive = _triangle.m_primitive;
+        input.m_color = _triangle.m_color;
+        input.m_varyings = values;
+        input.m_planes = planes;
+        input.m_texture = _triangle.m_texture;
+
+        for (int y = _minY; y <= _maxY; ++y) {
+            uint32* colorRow = _target.m_color + y * _target.m_pitch;
+            float32* depthRow = _target.m_depth + y * _target.m_pitch;
+
+            int64 w0Row = c[0] + (int64)b[0] * y;
+            int64 w1Row = c[1] + (int64)b[1] * y;
+            int64 w2Row = c[2] + (int64)b[2] * y;
+
+            float32 fy = (float32)y;
+            float32 zRow = _triangle.m_zc + _triangle.m_zdy * fy;
+            if (PixelStage::cVaryingCount > 0) {
+                for (int p = 0; p < cPlaneCount; ++p) {
+                    rowBase[p] = planes[p * 3 + 2] + planes[p * 3 + 1] * fy;
+                }
+            }
+
+            input.m_y = y;
+
+            for (int x = _minX; x <= _maxX; ++x) {
+                int64 w0 = w0Row + (int64)a[0] * x;
+                int64 w1 = w1Row + (int64)a[1] * x;
+                int64 w2 = w2Row + (int64)a[2] * x;
+                float32 fx = (float32)x;
+                float32 z = zRow + _triangle.m_zdx * fx;
+
+                if ((w0 | w1 | w2) < 0 || (PixelStage::cDepthTest && z > depthRow[x])) {
+                    continue;
+                }
+
+                if (PixelStage::cVaryingCount > 0) {
+                    float32 w = 1.f / (rowBase[0] + planes[0] * fx);
+                    for (int p = 1; p < cPlaneCount; ++p) {
+                        values[p - 1] = (rowBase[p] + planes[p * 3] * fx) * w;
+                    }
+                    input.m_w = w;
+                }
+
+                input.m_x = x;
+                input.m_z = z;
+                if (PixelStage::cDepthWrite) {
+                    depthRow[x] = z;
+                }
+                colorRow[x] = PixelStage::shade(input);
+                ++written;
+            }
+        }
+
+        return written;
+    }
+
+#if defined(SOFT_SIMD)
+    uint32 device::rasterize_sse2(const triangle& _triangle, const raster_target& _target, int _minX, int _minY, int _maxX, int _maxY)
+    {
+        const int32* a = _triangle.m_edgeA;
+        const int32* b = _triangle.m_edgeB;
+        const int64* c = _triangle.m_edgeC;
+
+        const __m128 lanes = _mm_setr_ps(0.f, 1.f, 2.f, 3.f);
+        const __m128i step0 = _mm_setr_epi32(0, a[0], a[0] * 2, a[0] * 3);
+        const __m128i step1 = _mm_setr_epi32(0, a[1], a[1] * 2, a[1] * 3);
+        const __m128i step2 = _mm_setr_epi32(0, a[2], a[2] * 2, a[2] * 3);
+        const __m128 zdx = _mm_set1_ps(_triangle.m_zdx);
+        const __m128i packed = _mm_set1_epi32((int)_triangle.m_color);
+        uint32 written = 0;
+
+        int blockEnd = _maxX + 1 - ((_maxX + 1 - _minX) & 3);
+
+        for (int y = _minY; y <= _maxY; ++y) {
+            uint32* colorRow = _target.m_color + y * _target.m_pitch;
+            float32* depthRow = _target.m_depth + y * _target.m_pitch;
+
+            int64 w0Base = c[0] + (int64)b[0] * y + (int64)a[0] * _minX;
+            int64 w1Base = c[1] + (int64)b[1] * y + (int64)a[1] * _minX;
+            int64 w2Base = c[2] + (int64)b[2] * y + (int64)a[2] * _minX;
+
+            float32 fy = (float32)y;
+            float32 zBase = _triangle.m_zc + _triangle.m_zdy * fy;
+            __m128 zRow = _mm_set1_ps(zBase);
+
+            int x = _minX;
+            for (; x < blockEnd; x += 4, w0Base += a[0] * 4, w1Base += a[1] * 4, w2Base += a[2] * 4) {
+                __m128i w0 = _mm_add_epi32(_mm_set1_epi32(clamp_edge(w0Base)), step0);
+                __m128i w1 = _mm_add_epi32(_mm_set1_epi32(clamp_edge(w1Base)), step1);
+                __m128i w2 = _mm_add_epi32(_mm_set1_epi32(clamp_edge(w2Base)), step2);
+
+                // a lane is inside when no edge value has its sign bit set
+                __m128 mask = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_or_si128(_mm_or_si128(w0, w1), w2), _mm_set1_epi32(-1)));
+                if (_mm_movemask_ps(mask) == 0) {
+                    continue;
+                }
+
+                __m128 fx = _mm_add_ps(_mm_set1_ps((float32)x), lanes);
+                __m128 z = _mm_add_ps(zRow, _mm_mul_ps(zdx, fx));
+                __m128 depth = _mm_loadu_ps(depthRow + x);
+                mask = _mm_and_ps(mask, _mm_cmple_ps(z, depth));
+                int bits = _mm_movemask_ps(mask);
+                if (bits == 0) {
+                    continue;
+                }
+                written += math::popcount(bits);
+
+                _mm_storeu_ps(depthRow + x, _mm_or_ps(_mm_and_ps(mask, z), _mm_andnot_ps(mask, depth)));
+
+                __m128i colorMask = _mm_castps_si128(mask);
+                __m128i color = _mm_loadu_si128((const __m128i*)(colorRow + x));
+                color = _mm_or_si128(_mm_and_si128(colorMask, packed), _mm_andnot_si128(colorMask, color));
+                _mm_storeu_si128((__m128i*)(colorRow + x), color);
+            }
+
+            for (; x <= _maxX; ++x, w0Base += a[0], w1Base += a[1], w2Base += a[2]) {
+                float32 z = zBase + _triangle.m_zdx * (float32)x;
+                if ((w0Base | w1Base | w2Base) >= 0 && z <= depthRow[x]) {
+                    depthRow[x] = z;
+                    colorRow[x] = _triangle.m_color;
+                    ++written;
+                }
+            }
+        }
+
+        return written;
+    }
+
+    SOFT_TARGET_AVX2 uint32 device::rasterize_avx2(const triangle& _triangle, const raster_target& _target, int _minX, int _minY, int _maxX, int _maxY)
+    {
+        const int32* a = _triangle.m_edgeA;
+        const int32* b = _triangle.m_edgeB;
+        const int64* c = _triangle.m_edgeC;
+
+        const __m256 lanes = _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f);
+        const __m256i laneIndex = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m256i step0 = _mm256_mullo_epi32(_mm256_set1_epi32(a[0]), laneIndex);
+        const __m256i step1 = _mm256_mullo_epi32(_mm256_set1_epi32(a[1]), laneIndex);
+        const __m256i step2 = _mm256_mullo_epi32(_mm256_set1_epi32(a[2]), laneIndex);
+        const __m256i allOnes = _mm256_set1_epi32(-1);
+        const __m256 zdx = _mm256_set1_ps(_triangle.m_zdx);
+        const __m256i packed = _mm256_set1_epi32((int)_triangle.m_color);
+        uint32 written = 0;
+
+        int blockEnd = _maxX + 1 - ((_maxX + 1 - _minX) & 7);
+
+        for (int y = _minY; y <= _maxY; ++y) {
+            uint32* colorRow = _target.m_color + y * _target.m_pitch;
+            float32* depthRow = _target.m_depth + y * _target.m_pitch;
+
+            int64 w0Base = c[0] + (int64)b[0] * y + (int64)a[0] * _minX;
+            int64 w1Base = c[1] + (int64)b[1] * y + (int64)a[1] * _minX;
+            int64 w2Base = c[2] + (int64)b[2] * y + (int64)a[2] * _minX;
+
+            float32 fy = (float32)y;
+            float32 zBase = _triangle.m_zc + _triangle.m_zdy * fy;
+            __m256 zRow = _mm256_set1_ps(zBase);
+
+            int x = _minX;
+            for (; x < blockEnd; x += 8, w0Base += a[0] * 8, w1Base += a[1] * 8, w2Base += a[2] * 8) {
+                __m256i w0 = _mm256_add_epi32(_mm256_set1_epi32(clamp_edge(w0Base)), step0);
+                __m256i w1 = _mm256_add_epi32(_mm256_set1_epi32(clamp_edge(w1Base)), step1);
+                __m256i w2 = _mm256_add_epi32(_mm256_set1_epi32(clamp_edge(w2Base)), step2);
+
+                __m256 mask = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_or_si256(_mm256_or_si256(w0, w1), w2), allOnes));
+                if (_mm256_movemask_ps(mask) == 0) {
+                    continue;
+                }
+
+                __m256 fx = _mm256_add_ps(_mm256_set1_ps((float32)x), lanes);
+                __m256 z = _mm256_add_ps(zRow, _mm256_mul_ps(zdx, fx));
+                __m256 depth = _mm256_loadu_ps(depthRow + x);
+                mask = _mm256_and_ps(mask, _mm256_cmp_ps(z, depth, _CMP_LE_OQ));
+                int bits = _mm256_movemask_ps(mask);
+                if (bits == 0) {
+                    continue;
+                }
+                written += math::popcount(bits);
+
+                _mm256_storeu_ps(depthRow + x, _mm256_blendv_ps(depth, z, mask));
+
+                __m256i color = _mm256_loadu_si256((const __m256i*)(colorRow + x));
+                color = _mm256_blendv_epi8(color, packed, _mm256_castps_si256(mask));
+                _mm256_storeu_si256((__m256i*)(colorRow + x), color);
+            }
+
+            for (; x <= _maxX; ++x, w0Base += a[0], w1Base += a[1], w2Base += a[2]) {
+                float32 z = zBase + _triangle.m_zdx * (float32)x;
+                if ((w0Base | w1Base | w2Base) >= 0 && z <= depthRow[x]) {
+                    depthRow[x] = z;
+                    colorRow[x] = _triangle.m_color;
+                    ++written;
+                }
+            }
+        }
+
+        return written;
+    }
+#endif
+
+    void device::bin_triangle(bin_set& _set, uint32 _index)
+    {
+        const triangle& tri = _set.m_triangles[_index];
+
+        int tileMinX = tri.m_minX / cTileSize;
+        int tileMaxX = tri.m_maxX / cTileSize;
+        int tileMinY = tri.m_minY / cTileSize;
+        int tileMaxY = tri.m_maxY / cTileSize;
+
+        for (int ty = tileMinY; ty <= tileMaxY; ++ty) {
+            for (int tx = tileMinX; tx <= tileMaxX; ++tx) {
+                _set.m_bins[ty * m_tilesX + tx].push_back(_index);
+            }
+        }
+    }
+
+    void device::rasterize_tile(bin_set& _set, int _tile)
+    {
+        auto& bin = _set.m_bins[_tile];
+        if (bin.empty()) {
+            return;
+        }
+
+        int tileMinX = (_tile % m_tilesX) * cTileSize;
+        int tileMinY = (_tile / m_tilesX) * cTileSize;
+        int tileMaxX = std::min(tileMinX + cTileSize, m_width) - 1;
+        int tileMaxY = std::min(tileMinY + cTileSize, m_height) - 1;
+
+        resolve_tile(_tile);
+        raster_target target = { m_buffer, m_depthBuffer, m_pitch, _set.m_varyings.data() };
+
+        uint64 pixels = 0;
+        uint64 rejected = 0;
+        for (uint32 index : bin) {
+            const triangle& tri = _set.m_triangles[index];
+            const shader_program* program = tri.m_program;
+            raster_kernel kernel = program && program->m_raster ? program->m_raster : m_rasterKernel;
+            bool depthTest = !program || program->m_depthTest;
+            bool depthWrite = !program || program->m_depthWrite;
+            int minX = std::max(tri.m_minX, tileMinX);
+            int minY = std::max(tri.m_minY, tileMinY);
+            int maxX = std::min(tri.m_maxX, tileMaxX);
+            int maxY = std::min(tri.m_maxY, tileMaxY);
+
+            // blocks whose farthest stored depth is nearer than the triangle's nearest point cannot pass a single pixel
+            int blockMinX = minX / cHiZBlockSize;
+            int blockMinY = minY / cHiZBlockSize;
+            int blockMaxX = maxX / cHiZBlockSize;
+            int blockMaxY = maxY / cHiZBlockSize;
+            int blockCount = (blockMaxX - blockMinX + 1) * (blockMaxY - blockMinY + 1);
+
+            int hidden = 0;
+            for (int by = blockMinY; by <= blockMaxY && depthTest; ++by) {
+                const float32* blockZ = &m_hiZ[by * m_hiZPitch];
+                for (int bx = blockMinX; bx <= blockMaxX; ++bx) {
+                    hidden += tri.m_minZ > blockZ[bx] ? 1 : 0;
+                }
+            }
+
+            rejected += hidden;
+            if (hidden == blockCount) {
+                continue;
+            }
+
+            if (hidden == 0) {
+                pixels += kernel(tri, target, minX, minY, maxX, maxY);
+            }
+            else {
+                // surviving neighbours in a block row are rasterized as one span to keep the kernel's rows long
+                for (int by = blockMinY; by <= blockMaxY; ++by) {
+                    const float32* blockZ = &m_hiZ[by * m_hiZPitch];
+                    int rowMinY = std::max(minY, by * cHiZBlockSize);
+                    int rowMaxY = std::min(maxY, by * cHiZBlockSize + cHiZBlockSize - 1);
+
+                    int bx = blockMinX;
+                    while (bx <= blockMaxX) {
+                        if (tri.m_minZ > blockZ[bx]) {
+                            ++bx;
+                            continue;
+                        }
+
+                        int spanStart = bx;
+                        while (bx <= blockMaxX && !(tri.m_minZ > blockZ[bx])) {
+                            ++bx;
+                        }
+
+                        int spanMinX = std::max(minX, spanStart * cHiZBlockSize);
+                        int spanMaxX = std::min(maxX, bx * cHiZBlockSize - 1);
+                        pixels += kernel(tri, target, spanMinX, rowMinY, spanMaxX, rowMaxY);
+                    }
+                }
+            }
+
+            // writing depth without testing it can raise a block's max, so those blocks start over
+            if (depthWrite && !depthTest) {
+                for (int by = blockMinY; by <= blockMaxY; ++by) {
+                    for (int bx = blockMinX; bx <= blockMaxX; ++bx) {
+                        m_hiZ[by * m_hiZPitch + bx] = std::numeric_limits<float32>::max();
+                    }
+                }
+            }
+            if (!depthWrite || !depthTest) {
+                continue;
+            }
+
+            // only blocks the triangle covers completely can lower their max, the rest keep a conservative value
+            for (int by = (minY + cHiZBlockSize - 1) / cHiZBlockSize; by < (maxY + 1) / cHiZBlockSize; ++by) {
+                float32* blockZ = &m_hiZ[by * m_hiZPitch];
+                for (int bx = (minX + cHiZBlockSize - 1) / cHiZBlockSize; bx < (maxX + 1) / cHiZBlockSize; ++bx) {
+                    float32 maxZ;
+                    int x = bx * cHiZBlockSize;
+                    int y = by * cHiZBlockSize;
+                    if (covers_block(tri, x, y, x + cHiZBlockSize - 1, y + cHiZBlockSize - 1, maxZ)) {
+                        blockZ[bx] = std::min(blockZ[bx], maxZ);
+                    }
+                }
+            }
+        }
+
+        m_tilePixels[_tile] += pixels;
+        m_tileBlocksRejected[_tile] += rejected;
+        bin.clear();
+    }
+
+    // the planes are linear, so a block is covered when its corner pixels are and its depth peaks at a corner
+    bool device::covers_block(const triangle& _triangle, int _minX, int _minY, int _maxX, int _maxY, float32& _maxZ)
+    {
+        const int32* a = _triangle.m_edgeA;
+        const int32* b = _triangle.m_edgeB;
+        const int64* c = _triangle.m_edgeC;
+
+        _maxZ = -std::numeric_limits<float32>::max();
+
+        int xs[2] = { _minX, _maxX };
+        int ys[2] = { _minY, _maxY };
+        for (int y : ys) {
+            for (int x : xs) {
+                for (int i = 0; i < 3; ++i) {
+                    if (c[i] + (int64)b[i] * y + (int64)a[i] * x < 0) {
+                        return false;
+                    }
+                }
+                float32 fx = (float32)x;
+                float32 fy = (float32)y;
+                _maxZ = std::max(_maxZ, (_triangle.m_zc + _triangle.m_zdy * fy) + _triangle.m_zdx * fx);
+            }
+        }
+
+        // interior pixels round differently from the corners
+        _maxZ += cHiZSlack;
+        return true;
+    }
+
+    glm::vec3 device::project(const glm::vec3& _position, const glm::mat4& _translationMatrix)
+    {
+        return project(_translationMatrix * glm::vec4(_position, 1.f));
+    }
+
+    glm::vec3 device::project(const glm::vec4& _clip) const
+    {
+        return project(_clip, (float32)m_width, (float32)m_height);
+    }
+
+    glm::vec3 device::project(const glm::vec4& _clip, float32 _width, float32 _height)
+    {
+        auto point = _clip / _clip.w;
+        float32 x = point.x * _width + _width / 2.f;
+        float32 y = -point.y * _height + _height / 2.f;
+        return glm::vec3(x, y, point.z);
+    }
+
+    // world matrices are rigid, so the sphere keeps its radius and the box only needs re-fitting
+    bool device::is_visible(const mesh& _mesh, const glm::mat4& _worldMatrix, const frustum& _frustum)
+    {
+        glm::vec3 center = glm::vec3(_worldMatrix * glm::vec4(_mesh.m_sphereCenter, 1.f));
+        if (!_frustum.intersects_sphere(center, _mesh.m_sphereRadius)) {
+            return false;
+        }
+
+        glm::vec3 worldMin, worldMax;
+        world_bounds(_mesh, _worldMatrix, worldMin, worldMax);
+        return _frustum.intersects_box(worldMin, worldMax);
+    }
+
+    void device::world_bounds(const mesh& _mesh, const glm::mat4& _worldMatrix, glm::vec3& _min, glm::vec3& _max)
+    {
+        glm::vec3 localCenter = (_mesh.m_boundsMin + _mesh.m_boundsMax) * 0.5f;
+        glm::vec3 localExtent = (_mesh.m_boundsMax - _mesh.m_boundsMin) * 0.5f;
+
+        glm::vec3 worldCenter = glm::vec3(_worldMatrix * glm::vec4(localCenter, 1.f));
+        glm::vec3 worldExtent;
+        for (int row = 0; row < 3; ++row) {
+            worldExtent[row] =
+                std::abs(_worldMatrix[0][row]) * localExtent.x +
+                std::abs(_worldMatrix[1][row]) * localExtent.y +
+                std::abs(_worldMatrix[2][row]) * localExtent.z;
+        }
+
+        _min = worldCenter - worldExtent;
+        _max = worldCenter + worldExtent;
+    }
+
+    // occluders are rasterized with planes shrunk to whole-pixel coverage and pushed back to the pixel's farthest depth,
+    // so a coarse pixel only ever claims depth the occluder really has everywhere inside it
+    void device::draw_occluder(const mesh& _mesh, const glm::mat4& _transformMatrix)
+    {
+        vertex_cache& cache = m_occlusionCache;
+        cache.reserve(_mesh.m_streamX.size());
+        m_transformKernel(_mesh, _transformMatrix, (float32)cOcclusionWidth, (float32)cOcclusionHeight, cache, 0, _mesh.m_streamX.size());
+
+        raster_target target = { m_occlusionColor.data(), m_occlusionDepth.data(), cOcclusionWidth, nullptr };
+
+        for (auto face : _mesh.m_faces) {
+            uint16 index[3] = { face.m_a, face.m_b, face.m_c };
+            if (cache.m_outside[index[0]] & cache.m_outside[index[1]] & cache.m_outside[index[2]]) {
+                continue;
+            }
+
+            glm::vec3 screen[cMaxClippedVertices];
+            int screenCount = 3;
+
+            uint32 planes = cache.m_guard[index[0]] | cache.m_guard[index[1]] | cache.m_guard[index[2]];
+            if (planes == 0) {
+                for (int v = 0; v < 3; ++v) {
+                    screen[v] = glm::vec3(cache.m_screenX[index[v]], cache.m_screenY[index[v]], cache.m_screenZ[index[v]]);
+                }
+            }
+            else {
+                clip_vertex clip[3];
+                for (int v = 0; v < 3; ++v) {
+                    clip[v].m_position = glm::vec4(cache.m_clipX[index[v]], cache.m_clipY[index[v]], cache.m_clipZ[index[v]], cache.m_clipW[index[v]]);
+                }
+                clip_vertex polygon[cMaxClippedVertices];
+                screenCount = clip_polygon(clip, 3, 0, planes, polygon);
+                for (int v = 0; v < screenCount; ++v) {
+                    screen[v] = project(polygon[v].m_position, (float32)cOcclusionWidth, (float32)cOcclusionHeight);
+                }
+            }
+
+            for (int v = 1; v + 1 < screenCount; ++v) {
+                triangle tri;
+                if (setup_planes(screen[0], screen[v], screen[v + 1], cOcclusionWidth, cOcclusionHeight, m_cullMode, tri) != setup_result::cAccepted) {
+                    continue;
+                }
+
+                // steps are whole multiples of cSubpixelSize, so half a pixel is exact
+                for (int i = 0; i < 3; ++i) {
+                    tri.m_edgeC[i] -= ((int64)std::abs(tri.m_edgeA[i]) + std::abs(tri.m_edgeB[i])) / 2;
+                }
+                tri.m_zc += 0.5f * (std::abs(tri.m_zdx) + std::abs(tri.m_zdy));
+                tri.m_color = 0;
+
+                m_rasterKernel(tri, target, tri.m_minX, tri.m_minY, tri.m_maxX, tri.m_maxY);
+            }
+        }
+    }
+
+    // tests the nearest corner of the world box against every coarse pixel its screen rect touches
+    bool device::is_occluded(const mesh& _mesh, const glm::mat4& _transformMatrix) const
+    {
+        glm::vec3 localMin = _mesh.m_boundsMin;
+        glm::vec3 localMax = _mesh.m_boundsMax;
+
+        float32 minX = std::numeric_limits<float32>::max();
+        float32 minY = std::numeric_limits<float32>::max();
+        float32 maxX = -std::numeric_limits<float32>::max();
+        float32 maxY = -std::numeric_limits<float32>::max();
+        float32 nearZ = std::numeric_limits<float32>::max();
+
+        for (int corner = 0; corner < 8; ++corner) {
+            glm::vec4 position(
+                (corner & 1) ? localMax.x : localMin.x,
+                (corner & 2) ? localMax.y : localMin.y,
+                (corner & 4) ? localMax.z : localMin.z,
+                1.f);
+            glm::vec4 clip = _transformMatrix * position;
+
+            // boxes reaching through the near plane project unbounded, keep them
+            if (clip.z < -clip.w || clip.w <= 0.f) {
+                return false;
+            }
+
+            glm::vec3 screen = project(clip, (float32)cOcclusionWidth, (float32)cOcclusionHeight);
+            minX = std::min(minX, screen.x);
+            minY = std::min(minY, screen.y);
+            maxX = std::max(maxX, screen.x);
+            maxY = std::max(maxY, screen.y);
+            nearZ = std::min(nearZ, screen.z);
+        }
+
+        int left = std::max((int)std::floor(minX), 0);
+        int top = std::max((int)std::floor(minY), 0);
+        int right = std::min((int)std::floor(maxX), cOcclusionWidth - 1);
+        int bottom = std::min((int)std::floor(maxY), cOcclusionHeight - 1);
+        if (left > right || top > bottom) {
+            return false;
+        }
+
+        for (int y = top; y <= bottom; ++y) {
+            const float32* row = &m_occlusionDepth[y * cOcclusionWidth];
+            for (int x = left; x <= right; ++x) {
+                if (!(nearZ > row[x])) {
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    void device::classify(const glm::vec4& _clip, uint32& _outside, uint32& _guard)
+    {
+        uint32 depth = 0;
+        if (_clip.z < -_clip.w) { depth |= cClipNear; }
+        if (_clip.z > _clip.w) { depth |= cClipFar; }
+
+        _outside = depth;
+        if (_clip.x < -_clip.w) { _outside |= cClipLeft; }
+        if (_clip.x > _clip.w) { _outside |= cClipRight; }
+        if (_clip.y < -_clip.w) { _outside |= cClipBottom; }
+        if (_clip.y > _clip.w) { _outside |= cClipTop; }
+
+        float32 guard = _clip.w * cGuardBand;
+        _guard = depth;
+        if (_clip.x < -guard) { _guard |= cClipLeft; }
+        if (_clip.x > guard) { _guard |= cClipRight; }
+        if (_clip.y < -guard) { _guard |= cClipBottom; }
+        if (_clip.y > guard) { _guard |= cClipTop; }
+    }
+
+    // sutherland-hodgman against each plane in _planes, _output needs room for cMaxClippedVertices
+    // varyings are linear in clip space, so they are cut at the same t as the position
+    int device::clip_polygon(const clip_vertex* _input, int _count, int _varyingCount, uint32 _planes, clip_vertex* _output)
+    {
+        clip_vertex buffers[2][cMaxClippedVertices];
+        const clip_vertex* source = _input;
+        int sourceCount = _count;
+        int target = 0;
+
+        for (int plane = 0; plane < cClipPlaneCount && sourceCount > 0; ++plane) {
+            if ((_planes & (1 << plane)) == 0) {
+                continue;
+            }
+
+            auto distance = [plane](const glm::vec4& _v) {
+                switch (plane) {
+                    case 0: return _v.z + _v.w;
+                    case 1: return _v.w - _v.z;
+                    case 2: return _v.x + _v.w * cGuardBand;
+                    case 3: return _v.w * cGuardBand - _v.x;
+                    case 4: return _v.y + _v.w * cGuardBand;
+                    default: return _v.w * cGuardBand - _v.y;
+                }
+            };
+
+            clip_vertex* destination = buffers[target];
+            int destinationCount = 0;
+
+            for (int i = 0; i < sourceCount; ++i) {
+                const clip_vertex& current = source[i];
+                const clip_vertex& next = source[(i + 1) % sourceCount];
+                float32 dCurrent = distance(current.m_position);
+                float32 dNext = distance(next.m_position);
+
+                if (dCurrent >= 0.f) {
+                    destination[destinationCount++] = current;
+                }
+
+                if ((dCurrent >= 0.f) != (dNext >= 0.f)) {
+                    float32 t = dCurrent / (dCurrent - dNext);
+                    clip_vertex& split = destination[destinationCount++];
+                    split.m_position = current.m_position + (next.m_position - current.m_position) * t;
+                    for (int v = 0; v < _varyingCount; ++v) {
+                        split.m_varyings[v] = current.m_varyings[v] + (next.m_varyings[v] - current.m_varyings[v]) * t;
+                    }
+                }
+            }
+
+            source = destination;
+            sourceCount = destinationCount;
+            target ^= 1;
+        }
+
+        std::copy(source, source + sourceCount, _output);
+        return sourceCount;
+    }
+
+    void device::vertex_cache::reserve(size_t _count)
+    {
+        if (m_clipX.size() >= _count) {
+            return;
+        }
+
+        for (auto* stream : { &m_clipX, &m_clipY, &m_clipZ, &m_clipW, &m_screenX, &m_screenY, &m_screenZ }) {
+            stream->resize(_count);
+        }
+        m_outside.resize(_count);
+        m_guard.resize(_count);
+    }
+
+    // large meshes are split into batches of cTransformBatch vertices across the scheduler
+    void device::transform_vertices(const mesh& _mesh, const glm::mat4& _transformMatrix, render_stats& _stats)
+    {
+        size_t count = _mesh.m_streamX.size();
+        m_vertexCache.reserve(count);
+
+        int batches = (int)((count + cTransformBatch - 1) / cTransformBatch);
+        m_scheduler->parallel_for(batches, [&](int _batch) {
+            size_t begin = (size_t)_batch * cTransformBatch;
+            size_t end = std::min(begin + cTransformBatch, count);
+            m_transformKernel(_mesh, _transformMatrix, (float32)m_width, (float32)m_height, m_vertexCache, begin, end);
+        });
+        _stats.m_vertices += _mesh.m_vertices.size();
+    }
+
+    // all transform kernels compute ((m0 * x + m1 * y) + m2 * z) + m3 and divide by w so they agree bit for bit
+    void device::transform_scalar(const mesh& _mesh, const glm::mat4& _matrix, float32 _width, float32 _height, vertex_cache& _cache, size_t _begin, size_t _end)
+    {
+        size_t count = std::min(_end, _mesh.m_vertices.size());
+        float32 halfWidth = _width * 0.5f;
+        float32 halfHeight = _height * 0.5f;
+
+        for (size_t i = _begin; i < count; ++i) {
+            float32 x = _mesh.m_streamX[i];
+            float32 y = _mesh.m_streamY[i];
+            float32 z = _mesh.m_streamZ[i];
+
+            glm::vec4 clip;
+            for (int row = 0; row < 4; ++row) {
+                clip[row] = _matrix[0][row] * x + _matrix[1][row] * y + _matrix[2][row] * z + _matrix[3][row];
+            }
+
+            _cache.m_clipX[i] = clip.x;
+            _cache.m_clipY[i] = clip.y;
+            _cache.m_clipZ[i] = clip.z;
+            _cache.m_clipW[i] = clip.w;
+
+            classify(clip, _cache.m_outside[i], _cache.m_guard[i]);
+
+            _cache.m_screenX[i] = (clip.x / clip.w) * _width + halfWidth;
+            _cache.m_screenY[i] = -(clip.y / clip.w) * _height + halfHeight;
+            _cache.m_screenZ[i] = clip.z / clip.w;
+        }
+    }
+
+#if defined(SOFT_SIMD)
+    void device::transform_sse2(const mesh& _mesh, const glm::mat4& _matrix, float32 _width, float32 _height, vertex_cache& _cache, size_t _begin, size_t _end)
+    {
+        __m128 m[4][4];
+        for (int column = 0; column < 4; ++column) {
+            for (int row = 0; row < 4; ++row) {
+                m[column][row] = _mm_set1_ps(_matrix[column][row]);
+            }
+        }
+
+        const __m128 width = _mm_set1_ps(_width);
+        const __m128 height = _mm_set1_ps(_height);
+        const __m128 halfWidth = _mm_set1_ps(_width * 0.5f);
+        const __m128 halfHeight = _mm_set1_ps(_height * 0.5f);
+        const __m128 guardBand = _mm_set1_ps(cGuardBand);
+        const __m128 signBit = _mm_set1_ps(-0.f);
+
+        const __m128i clipNear = _mm_set1_epi32(cClipNear);
+        const __m128i clipFar = _mm_set1_epi32(cClipFar);
+        const __m128i clipLeft = _mm_set1_epi32(cClipLeft);
+        const __m128i clipRight = _mm_set1_epi32(cClipRight);
+        const __m128i clipBottom = _mm_set1_epi32(cClipBottom);
+        const __m128i clipTop = _mm_set1_epi32(cClipTop);
+
+        for (size_t i = _begin; i < _end; i += 4) {
+            __m128 x = _mm_loadu_ps(&_mesh.m_streamX[i]);
+            __m128 y = _mm_loadu_ps(&_mesh.m_streamY[i]);
+            __m128 z = _mm_loadu_ps(&_mesh.m_streamZ[i]);
+
+            __m128 clip[4];
+            for (int row = 0; row < 4; ++row) {
+                clip[row] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0][row], x), _mm_mul_ps(m[1][row], y)), _mm_mul_ps(m[2][row], z)), m[3][row]);
+            }
+
+            _mm_storeu_ps(&_cache.m_clipX[i], clip[0]);
+            _mm_storeu_ps(&_cache.m_clipY[i], clip[1]);
+            _mm_storeu_ps(&_cache.m_clipZ[i], clip[2]);
+            _mm_storeu_ps(&_cache.m_clipW[i], clip[3]);
+
+            __m128 w = clip[3];
+            __m128 negW = _mm_xor_ps(w, signBit);
+            __m128 guard = _mm_mul_ps(w, guardBand);
+            __m128 negGuard = _mm_xor_ps(guard, signBit);
+
+            __m128i depth = _mm_or_si128(_mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(clip[2], negW)), clipNear), _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(clip[2], w)), clipFar));
+
+            __m128i outside = depth;
+            outside = _mm_or_si128(outside, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(clip[0], negW)), clipLeft));
+            outside = _mm_or_si128(outside, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(clip[0], w)), clipRight));
+            outside = _mm_or_si128(outside, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(clip[1], negW)), clipBottom));
+            outside = _mm_or_si128(outside, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(clip[1], w)), clipTop));
+            _mm_storeu_si128((__m128i*)&_cache.m_outside[i], outside);
+
+            __m128i guarded = depth;
+            guarded = _mm_or_si128(guarded, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(clip[0], negGuard)), clipLeft));
+            guarded = _mm_or_si128(guarded, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(clip[0], guard)), clipRight));
+            guarded = _mm_or_si128(guarded, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(clip[1], negGuard)), clipBottom));
+            guarded = _mm_or_si128(guarded, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(clip[1], guard)), clipTop));
+            _mm_storeu_si128((__m128i*)&_cache.m_guard[i], guarded);
+
+            __m128 screenX = _mm_add_ps(_mm_mul_ps(_mm_div_ps(clip[0], w), width), halfWidth);
+            __m128 screenY = _mm_add_ps(_mm_mul_ps(_mm_xor_ps(_mm_div_ps(clip[1], w), signBit), height), halfHeight);
+            _mm_storeu_ps(&_cache.m_screenX[i], screenX);
+            _mm_storeu_ps(&_cache.m_screenY[i], screenY);
+            _mm_storeu_ps(&_cache.m_screenZ[i], _mm_div_ps(clip[2], w));
+        }
+    }
+
+    SOFT_TARGET_AVX2 void device::transform_avx2(const mesh& _mesh, const glm::mat4& _matrix, float32 _width, float32 _height, vertex_cache& _cache, size_t _begin, size_t _end)
+    {
+        __m256 m[4][4];
+        for (int column = 0; column < 4; ++column) {
+            for (int row = 0; row < 4; ++row) {
+                m[column][row] = _mm256_set1_ps(_matrix[column][row]);
+            }
+        }
+
+        const __m256 width = _mm256_set1_ps(_width);
+        const __m256 height = _mm256_set1_ps(_height);
+        const __m256 halfWidth = _mm256_set1_ps(_width * 0.5f);
+        const __m256 halfHeight = _mm256_set1_ps(_height * 0.5f);
+        const __m256 guardBand = _mm256_set1_ps(cGuardBand);
+        const __m256 signBit = _mm256_set1_ps(-0.f);
+
+        const __m256i clipNear = _mm256_set1_epi32(cClipNear);
+        const __m256i clipFar = _mm256_set1_epi32(cClipFar);
+        const __m256i clipLeft = _mm256_set1_epi32(cClipLeft);
+        const __m256i clipRight = _mm256_set1_epi32(cClipRight);
+        const __m256i clipBottom = _mm256_set1_epi32(cClipBottom);
+        const __m256i clipTop = _mm256_set1_epi32(cClipTop);
+
+        for (size_t i = _begin; i < _end; i += 8) {
+            __m256 x = _mm256_loadu_ps(&_mesh.m_streamX[i]);
+            __m256 y = _mm256_loadu_ps(&_mesh.m_streamY[i]);
+            __m256 z = _mm256_loadu_ps(&_mesh.m_streamZ[i]);
+
+            __m256 clip[4];
+            for (int row = 0; row < 4; ++row) {
+                clip[row] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[0][row], x), _mm256_mul_ps(m[1][row], y)), _mm256_mul_ps(m[2][row], z)), m[3][row]);
+            }
+
+            _mm256_storeu_ps(&_cache.m_clipX[i], clip[0]);
+            _mm256_storeu_ps(&_cache.m_clipY[i], clip[1]);
+            _mm256_storeu_ps(&_cache.m_clipZ[i], clip[2]);
+            _mm256_storeu_ps(&_cache.m_clipW[i], clip[3]);
+
+            __m256 w = clip[3];
+            __m256 negW = _mm256_xor_ps(w, signBit);
+            __m256 guard = _mm256_mul_ps(w, guardBand);
+            __m256 negGuard = _mm256_xor_ps(guard, signBit);
+
+            __m256i depth = _mm256_or_si256(_mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(clip[2], negW, _CMP_LT_OQ)), clipNear), _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(clip[2], w, _CMP_GT_OQ)), clipFar));
+
+            __m256i outside = depth;
+            outside = _mm256_or_si256(outside, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(clip[0], negW, _CMP_LT_OQ)), clipLeft));
+            outside = _mm256_or_si256(outside, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(clip[0], w, _CMP_GT_OQ)), clipRight));
+            outside = _mm256_or_si256(outside, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(clip[1], negW, _CMP_LT_OQ)), clipBottom));
+            outside = _mm256_or_si256(outside, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(clip[1], w, _CMP_GT_OQ)), clipTop));
+            _mm256_storeu_si256((__m256i*)&_cache.m_outside[i], outside);
+
+            __m256i guarded = depth;
+            guarded = _mm256_or_si256(guarded, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(clip[0], negGuard, _CMP_LT_OQ)), clipLeft));
+            guarded = _mm256_or_si256(guarded, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(clip[0], guard, _CMP_GT_OQ)), clipRight));
+            guarded = _mm256_or_si256(guarded, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(clip[1], negGuard, _CMP_LT_OQ)), clipBottom));
+            guarded = _mm256_or_si256(guarded, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(clip[1], guard, _CMP_GT_OQ)), clipTop));
+            _mm256_storeu_si256((__m256i*)&_cache.m_guard[i], guarded);
+
+            __m256 screenX = _mm256_add_ps(_mm256_mul_ps(_mm256_div_ps(clip[0], w), width), halfWidth);
+            __m256 screenY = _mm256_add_ps(_mm256_mul_ps(_mm256_xor_ps(_mm256_div_ps(clip[1], w), signBit), height), halfHeight);
+            _mm256_storeu_ps(&_cache.m_screenX[i], screenX);
+            _mm256_storeu_ps(&_cache.m_screenY[i], screenY);
+            _mm256_storeu_ps(&_cache.m_screenZ[i], _mm256_div_ps(clip[2], w));
+        }
+    }
+#endif
+
+    void device::submit_triangle(bin_set& _set, const glm::vec3* _screen, const float32* _invW, const float32* const* _varyings, const color& _color, uint32 _primitive, const shader_program* _program, const texture* _texture)
+    {
+        int varyingCount = _program->m_varyingCount;
+
+        triangle tri;
+        barycentrics weights;
+        setup_result result = setup_planes(_screen[0], _screen[1], _screen[2], m_width, m_height, m_cullMode, tri, varyingCount > 0 ? &weights : nullptr);
+        if (result == setup_result::cCulled) {
+            ++_set.m_stats.m_trianglesCulled;
+        }
+        if (result != setup_result::cAccepted) {
+            return;
+        }
+
+        tri.m_color = color_pack(_color);
+        tri.m_varyingOffset = 0;
+        tri.m_varyingCount = 0;
+        tri.m_primitive = _primitive;
+        tri.m_program = _program;
+        tri.m_texture = _texture;
+
+        // plane 0 is 1/w, plane k + 1 is varying k divided by w, each stored as a, b, c
+        if (varyingCount > 0) {
+            tri.m_varyingOffset = (uint32)_set.m_varyings.size();
+            tri.m_varyingCount = (uint32)varyingCount;
+
+            for (int p = 0; p <= varyingCount; ++p) {
+                float64 a = 0.0, b = 0.0, c = 0.0;
+                for (int v = 0; v < 3; ++v) {
+                    float64 value = p == 0 ? _invW[v] : (float64)_varyings[v][p - 1] * _invW[v];
+                    a += weights.m_a[v] * value;
+                    b += weights.m_b[v] * value;
+                    c += weights.m_c[v] * value;
+                }
+                _set.m_varyings.push_back((float32)a);
+                _set.m_varyings.push_back((float32)b);
+                _set.m_varyings.push_back((float32)c);
+            }
+        }
+
+        _set.m_triangles.push_back(tri);
+        bin_triangle(_set, (uint32)_set.m_triangles.size() - 1);
+    }
+
+    SDL_Surface* device::create_surface(buffer_type _bufferType)
+    {
+        resolve();
+
+        switch (_bufferType) {
+            default:
+            case buffer_type::cColor:
+                if (m_colorsHandedOff) {
+                    return nullptr;
+                }
+                return SDL_CreateRGBSurfaceFrom(m_buffer, m_width, m_height, 32, m_pitch * 4, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
 
             case buffer_type::cDepth:
                 {
-                    float32 maxDepth = 0.f;
-                    for (int i = 0; i < m_width * m_height; ++i) {
-                        if (m_depthBuffer[i] < std::numeric_limits<float32>::max() && m_depthBuffer[i] > maxDepth) {
-                            maxDepth = m_depthBuffer[i];
+                    // one maximum per row, reduced afterwards so rows can run on any worker
+                    std::vector<float32> rowMax(m_height, 0.f);
+                    m_scheduler->parallel_for(m_height, [&](int _y) {
+                        const float32* row = m_depthBuffer + _y * m_pitch;
+                        for (int x = 0; x < m_width; ++x) {
+                            if (row[x] < std::numeric_limits<float32>::max() && row[x] > rowMax[_y]) {
+                                rowMax[_y] = row[x];
+                            }
                         }
+                    }, cTileSize);
+                    float32 maxDepth = *std::max_element(rowMax.begin(), rowMax.end());
+
+                    // the surface owns its pixels, a surface made from a temporary buffer would outlive it
+                    auto result = SDL_CreateRGBSurface(0, m_width, m_height, 8, 0x00, 0xFF, 0xFF, 0xFF);
+                    if (!result) {
+                        return nullptr;
                     }
-                    uint8* depth = new uint8[m_width * m_height];
-                    for (int i = 0; i < m_width * m_height; ++i) {
-                        if (m_depthBuffer[i] < std::numeric_limits<float32>::max()) {
-                            float32 d = m_depthBuffer[i] / maxDepth;
-                            depth[i] = (uint8)(d * 255);
-                        }
-                        else {
-                            depth[i] = 0x00;
+
+                    m_scheduler->parallel_for(m_height, [&](int _y) {
+                        const float32* row = m_depthBuffer + _y * m_pitch;
+                        uint8* depth = (uint8*)result->pixels + _y * result->pitch;
+                        for (int x = 0; x < m_width; ++x) {
+                            if (row[x] < std::numeric_limits<float32>::max()) {
+                                float32 d = row[x] / maxDepth;
+                                depth[x] = (uint8)(d * 255);
+                            }
+                            else {
+                                depth[x] = 0x00;
+                            }
                         }
+                    }, cTileSize);
+
+                    return result;
+                }
+        }
+    }
+
+    void device::render(const camera& _camera, mesh* _meshes, int _meshCount)
+    {
+        prepare(_camera, _meshes, _meshCount, 0);
+        rasterize(0);
+    }
+
+    // touches only the bin set and geometry scratch, never the color, depth or hierarchical z buffers
+    void device::prepare(const camera& _camera, mesh* _meshes, int _meshCount, int _set)
+    {
+        bin_set& set = m_binSets[_set];
+        render_stats& stats = set.m_stats;
+        stats = render_stats();
+
+        auto viewMatrix = glm::lookAt(_camera.m_position, _camera.m_target, glm::vec3(0.f, 1.f, 0.f));
+        auto projectionMatrix = glm::perspective(1.75f, (float32)m_width / (float32)m_height, 0.1f, 1000.f);
+
+        auto viewProjection = projectionMatrix * viewMatrix;
+        auto viewFrustum = frustum::from_matrix(viewProjection);
+
+        auto transformStart = timing::clock::now();
+
+        // nearest meshes first, so the hierarchical z has occluders in place before what they hide arrives
+        glm::vec3 forward = glm::normalize(_camera.m_target - _camera.m_position);
+        m_drawOrder.clear();
+        for (int i = 0; i < _meshCount; ++i) {
+            auto worldMatrix = _meshes[i].get_world_matrix();
+            if (!is_visible(_meshes[i], worldMatrix, viewFrustum)) {
+                ++stats.m_meshesCulled;
+                continue;
+            }
+
+            glm::vec3 center = glm::vec3(worldMatrix * glm::vec4(_meshes[i].m_sphereCenter, 1.f));
+            m_drawOrder.push_back(std::make_pair(glm::dot(center - _camera.m_position, forward), i));
+        }
+        std::sort(m_drawOrder.begin(), m_drawOrder.end());
+
+        bool hasOccluders = false;
+        for (const auto& draw : m_drawOrder) {
+            const mesh& occluder = _meshes[draw.second];
+            if (!occluder.m_occluder) {
+                continue;
+            }
+
+            if (!hasOccluders) {
+                m_occlusionDepth.assign(cOcclusionWidth * cOcclusionHeight, std::numeric_limits<float32>::max());
+                m_occlusionColor.resize(cOcclusionWidth * cOcclusionHeight);
+                hasOccluders = true;
+            }
+            draw_occluder(occluder, viewProjection * occluder.get_world_matrix());
+        }
+
+        for (const auto& draw : m_drawOrder) {
+            int i = draw.second;
+            auto worldMatrix = _meshes[i].get_world_matrix();
+
+            if (hasOccluders && !_meshes[i].m_occluder && is_occluded(_meshes[i], viewProjection * worldMatrix)) {
+                ++stats.m_meshesOccluded;
+                continue;
+            }
+
+            // every vertex is transformed once, faces then only gather from the cache
+            transform_vertices(_meshes[i], viewProjection * worldMatrix, stats);
+
+            const vertex_cache& cache = m_vertexCache;
+            const mesh& current = _meshes[i];
+            const shader_program* program = current.m_program ? current.m_program : get_default_program();
+            int varyingCount = program->m_varyingCount;
+
+            if (varyingCount > 0) {
+                uint32 vertexCount = (uint32)current.m_vertices.size();
+                m_vertexVaryings.resize(vertexCount * varyingCount);
+                m_scheduler->parallel_for((int)vertexCount, [&](int _vertex) {
+                    program->m_vertex(current, (uint32)_vertex, &m_vertexVaryings[_vertex * varyingCount]);
+                }, cTransformBatch);
+            }
+
+            uint32 primitive = 0;
+            for (auto face : _meshes[i].m_faces) {
+                uint16 index[3] = { face.m_a, face.m_b, face.m_c };
+
+                color faceColor = program->m_primitiveColor(primitive);
+                uint32 faceIndex = primitive++;
+                ++stats.m_triangles;
+
+                if (cache.m_outside[index[0]] & cache.m_outside[index[1]] & cache.m_outside[index[2]]) {
+                    continue;
+                }
+
+                uint32 planes = cache.m_guard[index[0]] | cache.m_guard[index[1]] | cache.m_guard[index[2]];
+                if (planes == 0) {
+                    glm::vec3 screen[3];
+                    float32 invW[3];
+                    const float32* varyings[3];
+                    for (int v = 0; v < 3; ++v) {
+                        screen[v] = glm::vec3(cache.m_screenX[index[v]], cache.m_screenY[index[v]], cache.m_screenZ[index[v]]);
+                        invW[v] = 1.f / cache.m_clipW[index[v]];
+                        varyings[v] = varyingCount > 0 ? &m_vertexVaryings[index[v] * varyingCount] : nullptr;
                     }
+                    submit_triangle(set, screen, invW, varyings, faceColor, faceIndex, program, current.m_texture);
+                    continue;
+                }
+
+                ++stats.m_trianglesClipped;
+
+                clip_vertex clip[3];
+                for (int v = 0; v < 3; ++v) {
+                    clip[v].m_position = glm::vec4(cache.m_clipX[index[v]], cache.m_clipY[index[v]], cache.m_clipZ[index[v]], cache.m_clipW[index[v]]);
+                    for (int k = 0; k < varyingCount; ++k) {
+                        clip[v].m_varyings[k] = m_vertexVaryings[index[v] * varyingCount + k];
+                    }
+                }
+                clip_vertex polygon[cMaxClippedVertices];
+                int polygonCount = clip_polygon(clip, 3, varyingCount, planes, polygon);
+                for (int v = 1; v + 1 < polygonCount; ++v) {
+                    const clip_vertex* fan[3] = { &polygon[0], &polygon[v], &polygon[v + 1] };
+                    glm::vec3 screen[3];
+                    float32 invW[3];
+                    const float32* varyings[3];
+                    for (int k = 0; k < 3; ++k) {
+                        screen[k] = project(fan[k]->m_position);
+                        invW[k] = 1.f / fan[k]->m_position.w;
+                        varyings[k] = fan[k]->m_varyings;
+                    }
+                    submit_triangle(set, screen, invW, varyings, faceColor, faceIndex, program, current.m_texture);
+                }
+            }
+        }
+
+        stats.m_transformMs += timing::elapsed_ms(transformStart);
+        stats.m_trianglesRasterized += set.m_triangles.size();
+    }
+
+    void device::rasterize(int _set)
+    {
+        bin_set& set = m_binSets[_set];
+
+        m_stats.m_meshesCulled += set.m_stats.m_meshesCulled;
+        m_stats.m_meshesOccluded += set.m_stats.m_meshesOccluded;
+        m_stats.m_vertices += set.m_stats.m_vertices;
+        m_stats.m_triangles += set.m_stats.m_triangles;
+        m_stats.m_trianglesRasterized += set.m_stats.m_trianglesRasterized;
+        m_stats.m_trianglesClipped += set.m_stats.m_trianglesClipped;
+        m_stats.m_trianglesCulled += set.m_stats.m_trianglesCulled;
+        m_stats.m_transformMs += set.m_stats.m_transformMs;
+
+        auto rasterizeStart = timing::clock::now();
+
+        // tiles own disjoint rects of the color and depth buffers so workers never contend. each worker is hinted a
+        // fixed run of neighbouring tiles, so a tile's buffers and the texels around it stay in one cache from frame to
+        // frame as long as nothing is stolen
+        int tileCount = m_tilesX * m_tilesY;
+        int workerCount = m_scheduler->get_thread_count();
+        jobs::task_group tiles;
+        for (int tile = 0; tile < tileCount; ++tile) {
+            if (!set.m_bins[tile].empty()) {
+                m_scheduler->submit(tiles, [this, &set, tile]() { rasterize_tile(set, tile); }, tile * workerCount / tileCount);
+            }
+        }
+        m_scheduler->wait(tiles);
+
+        for (auto& pixels : m_tilePixels) {
+            m_stats.m_pixels += pixels;
+            pixels = 0;
+        }
+
+        for (auto& rejected : m_tileBlocksRejected) {
+            m_stats.m_blocksRejected += rejected;
+            rejected = 0;
+        }
+
+        m_stats.m_rasterizeMs += timing::elapsed_ms(rasterizeStart);
+        set.m_triangles.clear();
+        set.m_varyings.clear();
+    }
+
+    // geometry for frame n + 1 runs on its own thread while the caller rasterizes frame n. bin sets circulate through
+    // two bounded queues, so the geometry stage never runs more than cBinSetCount - 1 frames ahead
+    class frame_pipeline
+    {
+    public:
+        typedef std::function<void(int _frame, int _set)> stage_function;
+
+        frame_pipeline();
+
+        // _geometry animates the scene and calls device::prepare, _raster calls device::rasterize and presents
+        void run(int _frameCount, const stage_function& _geometry, const stage_function& _raster);
+
+    private:
+        struct frame_ticket
+        {
+            int m_frame = 0;
+            int m_set = 0;
+        };
+
+        jobs::bounded_queue<int> m_freeSets;
+        jobs::bounded_queue<frame_ticket> m_readySets;
+    };
+
+    frame_pipeline::frame_pipeline()
+        : m_freeSets(device::cBinSetCount), m_readySets(device::cBinSetCount)
+    {
+        for (int set = 0; set < device::cBinSetCount; ++set) {
+            m_freeSets.push(set);
+        }
+    }
+
+    void frame_pipeline::run(int _frameCount, const stage_function& _geometry, const stage_function& _raster)
+    {
+        std::thread geometry([&]() {
+            for (int frame = 0; frame < _frameCount; ++frame) {
+                frame_ticket ticket;
+                ticket.m_frame = frame;
+                ticket.m_set = m_freeSets.pop();
+                _geometry(frame, ticket.m_set);
+                m_readySets.push(ticket);
+            }
+        });
+
+        for (int frame = 0; frame < _frameCount; ++frame) {
+            frame_ticket ticket = m_readySets.pop();
+            _raster(ticket.m_frame, ticket.m_set);
+            m_freeSets.push(ticket.m_set);
+        }
+
+        geometry.join();
+    }
+
+    // n color buffers for a device. the render thread draws into one while a dedicated present thread hands finished
+    // ones to _present, so conversions and file writes no longer stall rendering. SDL video calls must stay on the
+    // main thread, _present only converts or writes the frame and leaves showing it to the caller
+    class swap_chain
+    {
+    public:
+        // runs on the present thread
+        typedef std::function<void(const uint32* _colors, int _width, int _height, int _pitch)> present_function;
+
+        swap_chain(int _bufferCount, const present_function& _present);
+        ~swap_chain();
+
+        swap_chain(const swap_chain&) = delete;
+        swap_chain& operator=(const swap_chain&) = delete;
+
+        // attaches a free buffer as the device's color target, blocks while every buffer waits to be presented
+        void acquire(device& _device);
+        // fills the pending tiles of the attached buffer and queues it, the device hands the frame off and goes back to
+        // its own buffer
+        void present(device& _device);
+        // waits until everything queued has been presented
+        void flush();
+
+    private:
+        struct image
+        {
+            memory::surface_buffer<uint32> m_colors;
+            int m_width = 0;
+            int m_height = 0;
+            int m_pitch = 0;
+        };
+
+        static const int cQuit = -1;
+
+        void present_main();
+
+        std::vector<image> m_images;
+        jobs::bounded_queue<int> m_free;
+        jobs::bounded_queue<int> m_queued;
+        present_function m_present;
+        int m_current = -1;
+        int m_pending = 0;
+        std::mutex m_mutex;
+        std::condition_variable m_presented;
+        std::thread m_thread;
+    };
+
+    swap_chain::swap_chain(int _bufferCount, const present_function& _present)
+        : m_images(std::max(_bufferCount, 1)), m_free(m_images.size()), m_queued(m_images.size() + 1), m_present(_present)
+    {
+        for (int i = 0; i < (int)m_images.size(); ++i) {
+            m_free.push(i);
+        }
+        m_thread = std::thread(&swap_chain::present_main, this);
+    }
+
+    swap_chain::~swap_chain()
+    {
+        m_queued.push(cQuit);
+        m_thread.join();
+    }
+
+    void swap_chain::acquire(device& _device)
+    {
+        if (m_current < 0) {
+            m_current = m_free.pop();
+        }
+
+        image& target = m_images[m_current];
+        target.m_width = _device.get_width();
+        target.m_height = _device.get_height();
+        target.m_pitch = _device.get_pitch();
+        target.m_colors.resize(target.m_pitch * target.m_height, _device.get_page_mode());
+        _device.set_color_target(target.m_colors.data());
+    }
+
+    void swap_chain::present(device& _device)
+    {
+        if (m_current < 0) {
+            return;
+        }
+
+        // pending tiles would show whatever this buffer held frames ago
+        _device.fill_pending_colors();
+        _device.hand_off_color_target();
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_pending;
+        }
+        m_queued.push(m_current);
+        m_current = -1;
+    }
+
+    void swap_chain::flush()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_presented.wait(lock, [this]() { return m_pending == 0; });
+    }
+
+    void swap_chain::present_main()
+    {
+        while (true) {
+            int index = m_queued.pop();
+            if (index == cQuit) {
+                break;
+            }
 
-                    auto result = SDL_CreateRGBSurfaceFrom(depth, m_width, m_height, 8, m_width, 0x00, 0xFF, 0xFF, 0xFF);
-                    delete depth;
-                    return result;
-                }
+            const image& frame = m_images[index];
+            m_present(frame.m_colors.data(), frame.m_width, frame.m_height, frame.m_pitch);
+            m_free.push(index);
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                --m_pending;
+            }
+            m_presented.notify_all();
         }
     }
 
-    void device::render(const camera& _camera, mesh* _meshes, int _meshCount)
+    class presenter
     {
-        auto viewMatrix = glm::lookAt(_camera.m_position, _camera.m_target, glm::vec3(0.f, 1.f, 0.f));
-        auto projectionMatrix = glm::perspective(1.75f, (float32)m_width / (float32)m_height, 0.1f, 1000.f);
+    public:
+        explicit presenter(SDL_Renderer* _renderer);
+        ~presenter();
 
-        for (int i = 0; i < _meshCount; ++i) {
-            glm::mat4 rotation = glm::rotate(glm::mat4(1.f), _meshes[i].m_rotation.y, glm::vec3(0.f, 1.f, 0.f));
-            rotation = glm::rotate(rotation, _meshes[i].m_rotation.x, glm::vec3(1.f, 0.f, 0.f));
-            rotation = glm::rotate(rotation, _meshes[i].m_rotation.z, glm::vec3(0.f, 0.f, 1.f));
+        presenter(const presenter&) = delete;
+        presenter& operator=(const presenter&) = delete;
 
-            glm::mat4 translation = glm::translate(glm::mat4(1.f), _meshes[i].m_position);
-            auto worldMatrix = translation * rotation;
+        // uploads the frame once and lets the renderer scale it into _destination
+        void present(const uint32* _colors, int _width, int _height, int _pitch, const SDL_Rect* _destination = nullptr);
 
-            auto transformMatrix = projectionMatrix * viewMatrix * worldMatrix;
+    private:
+        bool ensure_texture(int _width, int _height);
 
-            int count = 0;
-            for (auto face : _meshes[i].m_faces) {
-                auto vertexA = _meshes[i].m_vertices[face.m_a];
-                auto vertexB = _meshes[i].m_vertices[face.m_b];
-                auto vertexC = _meshes[i].m_vertices[face.m_c];
+        SDL_Renderer* m_renderer = nullptr;
+        SDL_Texture* m_texture = nullptr;
+        int m_width = 0;
+        int m_height = 0;
+    };
 
-                auto pointA = project(vertexA, transformMatrix);
-                auto pointB = project(vertexB, transformMatrix);
-                auto pointC = project(vertexC, transformMatrix);
+    presenter::presenter(SDL_Renderer* _renderer)
+        : m_renderer(_renderer)
+    {
+        SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
+    }
+
+    presenter::~presenter()
+    {
+        if (m_texture) {
+            SDL_DestroyTexture(m_texture);
+        }
+    }
+
+    void presenter::present(const uint32* _colors, int _width, int _height, int _pitch, const SDL_Rect* _destination /* = nullptr */)
+    {
+        if (!ensure_texture(_width, _height)) {
+            return;
+        }
 
-                draw_triangle(pointA, pointB, pointC, (count++ % 2 == 0) ? color::s_yellow : color::s_cyan);
-                //draw_line(pointA, pointB, color::s_yellow);
-                //draw_line(pointA, pointC, color::s_yellow);
-                //draw_line(pointB, pointC, color::s_yellow);
+        void* pixels = nullptr;
+        int pitch = 0;
+        if (SDL_LockTexture(m_texture, nullptr, &pixels, &pitch) == 0) {
+            for (int y = 0; y < _height; ++y) {
+                memcpy((byte*)pixels + y * pitch, _colors + y * _pitch, _width * sizeof(uint32));
             }
+            SDL_UnlockTexture(m_texture);
+        }
+        else {
+            SDL_UpdateTexture(m_texture, nullptr, _colors, _pitch * sizeof(uint32));
+        }
+
+        SDL_RenderCopy(m_renderer, m_texture, nullptr, _destination);
+    }
+
+    bool presenter::ensure_texture(int _width, int _height)
+    {
+        if (m_texture && m_width == _width && m_height == _height) {
+            return true;
         }
+
+        if (m_texture) {
+            SDL_DestroyTexture(m_texture);
+        }
+
+        m_width = _width;
+        m_height = _height;
+        m_texture = SDL_CreateTexture(m_renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, m_width, m_height);
+        if (!m_texture) {
+            std::cerr << "presenter: unable to create texture: " << SDL_GetError() << "\n";
+            return false;
+        }
+        return true;
     }
 }
 
@@ -454,139 +3518,835 @@ namespace constants
 {
     const int width = 1920;
     const int height = 1080;
+
+    // per frame, so headless and benchmark runs are reproducible
+    const glm::vec3 rotationStep(0.0023f, 0.001f, 0.f);
 }
 
-int main(int argc, char* argv[])
+namespace image
+{
+    bool write_ppm(std::ostream& _stream, const uint32* _colors, int _width, int _height, int _pitch);
+
+    bool write_ppm(std::ostream& _stream, const uint32* _colors, int _width, int _height, int _pitch)
+    {
+        _stream << "P6\n" << _width << " " << _height << "\n255\n";
+
+        std::vector<byte> row(_width * 3);
+        for (int y = 0; y < _height; ++y) {
+            const uint32* source = _colors + y * _pitch;
+            for (int x = 0; x < _width; ++x) {
+                row[x * 3 + 0] = (byte)(source[x] >> 16);
+                row[x * 3 + 1] = (byte)(source[x] >> 8);
+                row[x * 3 + 2] = (byte)(source[x] >> 0);
+            }
+            _stream.write((const char*)row.data(), row.size());
+        }
+
+        return _stream.good();
+    }
+}
+
+namespace app
 {
-    SDL_Window* window = SDL_CreateWindow("Soft Renderer", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, constants::width, constants::height, SDL_WINDOW_SHOWN);
-    SDL_Renderer* renderer = SDL_CreateRenderer(window, 0, SDL_RENDERER_ACCELERATED);
-
-    int pixelSize = 30;
-    video::device device(constants::width / pixelSize, constants::height / pixelSize);
-
-    const float halfSize = 3.f;
-
-    glm::vec3 vertices[8] = {
-        { -halfSize, halfSize, halfSize },
-        { halfSize, halfSize, halfSize },
-        { -halfSize, -halfSize, halfSize },
-        { halfSize, -halfSize, halfSize },
-        { -halfSize, halfSize, -halfSize },
-        { halfSize, halfSize, -halfSize },
-        { halfSize, -halfSize, -halfSize },
-        { -halfSize, -halfSize, -halfSize },
+    struct options
+    {
+        bool m_headless = false;
+        bool m_benchmark = false;
+        bool m_csv = false;
+        bool m_pipeline = false;
+        int m_frames = 0;
+        int m_pixelSize = 0;
+        int m_threads = 0;
+        int m_buffers = 3;
+        bool m_hugePages = false;
+        std::string m_output;
+    };
+
+    struct benchmark_scene
+    {
+        std::string m_name;
+        std::vector<video::mesh> m_meshes;
+        video::camera m_camera;
+        // static scenes keep the meshes as built instead of turning them a little every frame
+        bool m_animated = true;
     };
 
-    uint16 indices[12 * 3] = {
-        0, 1, 2,
-        1, 2, 3,
-        1, 3, 6,
-        1, 5, 6,
-        0, 1, 4,
-        1, 4, 5,
-        2, 3, 7,
-        3, 6, 7,
-        0, 2, 7,
-        0, 4, 7,
-        4, 5, 6,
-        4, 6, 7
+    struct sample_summary
+    {
+        float64 m_min = 0.0;
+        float64 m_median = 0.0;
+        float64 m_p99 = 0.0;
     };
 
-    video::mesh cubeMesh(vertices, 8, indices, 12);
-
-    bool isRunning = true;
-
-    video::camera defaultCamera;
-    defaultCamera.m_position = glm::vec3(0.f, 0.f, 10.f);
-    defaultCamera.m_target = glm::vec3(0.f, 0.f, 0.f);
-
-    glm::vec3 pa1(constants::width / pixelSize / 2, 20, 3);
-    glm::vec3 pa2(pa1.x - 30, pa1.y + 40, 3);
-    glm::vec3 pa3(pa1.x + 30, pa1.y + 40, 3);
-
-    glm::vec3 pb1(pa1.x + 20, pa1.y, 5);
-    glm::vec3 pb2(pb1.x - 30, pb1.y + 45, 1);
-    glm::vec3 pb3(pb1.x + 30, pb1.y + 40, 5);
-
-    SDL_Surface* shawnSurface = IMG_Load("shawn2.jpg");
-    SDL_Texture* shawnTexture = SDL_CreateTextureFromSurface(renderer, shawnSurface);
-    SDL_FreeSurface(shawnSurface);
-
-    while (isRunning) {
-        SDL_Event event;
-        while (SDL_PollEvent(&event)) {
-            switch (event.type) {
-            case SDL_KEYDOWN:
-                switch (event.key.keysym.scancode) {
-                    case SDL_SCANCODE_ESCAPE:
-                        isRunning = false;
-                        break;
-
-                    case SDL_SCANCODE_MINUS:
-                        pixelSize--;
-                        pixelSize = std::max(pixelSize, 1);
-                        device.resize(constants::width / pixelSize, constants::height / pixelSize);
-                        break;
-
-                    case SDL_SCANCODE_EQUALS:
-                        pixelSize++;
-                        pixelSize = std::min(pixelSize, 128);
-                        device.resize(constants::width / pixelSize, constants::height / pixelSize);
-                        break;
-                    default:
-                        break;
+    bool parse_options(int _argc, char* _argv[], options& _options);
+    video::mesh create_cube(float32 _halfSize);
+    video::mesh create_sphere(float32 _radius, int _rings, int _segments);
+    video::mesh create_floor(float32 _halfSize, float32 _repeat);
+    video::mesh create_quad(float32 _halfWidth, float32 _halfHeight, float32 _angle, glm::vec2 _uvCenter, float32 _uvPerUnit);
+    void add_normal_colors(video::mesh& _mesh);
+    const video::texture* get_checker_texture();
+    const video::texture* get_photo_texture();
+    const video::texture* get_pattern_texture(video::texture::layout _layout);
+    std::vector<benchmark_scene> create_benchmark_scenes();
+    sample_summary summarize(std::vector<float64> _samples);
+    const char* kernel_name(video::device::kernel_type _kernel);
+    int run_headless(const options& _options);
+    int run_benchmark(const options& _options);
+    int run_interactive(const options& _options);
+
+    bool parse_options(int _argc, char* _argv[], options& _options)
+    {
+        for (int i = 1; i < _argc; ++i) {
+            std::string arg = _argv[i];
+            bool hasValue = i + 1 < _argc;
+
+            if (arg == "--headless") {
+                _options.m_headless = true;
+            }
+            else if (arg == "--benchmark") {
+                _options.m_benchmark = true;
+            }
+            else if (arg == "--format" && hasValue) {
+                std::string format = _argv[++i];
+                if (format != "json" && format != "csv") {
+                    std::cerr << "unknown format " << format << "\n";
+                    return false;
                 }
-                break;
+                _options.m_csv = format == "csv";
+            }
+            else if (arg == "--frames" && hasValue) {
+                _options.m_frames = std::max(std::atoi(_argv[++i]), 1);
+            }
+            else if (arg == "--pixel-size" && hasValue) {
+                _options.m_pixelSize = std::min(std::max(std::atoi(_argv[++i]), 1), 128);
+            }
+            else if (arg == "--buffers" && hasValue) {
+                _options.m_buffers = std::min(std::max(std::atoi(_argv[++i]), 1), 8);
+            }
+            else if (arg == "--huge-pages") {
+                _options.m_hugePages = true;
+            }
+            else if (arg == "--pipeline") {
+                _options.m_pipeline = true;
+            }
+            else if (arg == "--threads" && hasValue) {
+                _options.m_threads = std::max(std::atoi(_argv[++i]), 1);
+            }
+            else if (arg == "--output" && hasValue) {
+                _options.m_output = _argv[++i];
+            }
+            else {
+                std::cerr << "usage: " << _argv[0] << " [--headless | --benchmark [--format json|csv]] [--frames n] [--pixel-size n] [--threads n] [--buffers n] [--pipeline] [--huge-pages] [--output path|-]\n";
+                return false;
+            }
+        }
 
-            case SDL_QUIT:
-                isRunning = false;
-                break;
+        return true;
+    }
+
+    video::mesh create_cube(float32 _halfSize)
+    {
+        glm::vec3 vertices[8] = {
+            { -_halfSize, _halfSize, _halfSize },
+            { _halfSize, _halfSize, _halfSize },
+            { -_halfSize, -_halfSize, _halfSize },
+            { _halfSize, -_halfSize, _halfSize },
+            { -_halfSize, _halfSize, -_halfSize },
+            { _halfSize, _halfSize, -_halfSize },
+            { _halfSize, -_halfSize, -_halfSize },
+            { -_halfSize, -_halfSize, -_halfSize },
+        };
+
+        // counter clockwise seen from outside
+        uint16 indices[12 * 3] = {
+            0, 2, 1,
+            1, 2, 3,
+            1, 3, 6,
+            1, 6, 5,
+            0, 1, 4,
+            1, 5, 4,
+            2, 7, 3,
+            3, 7, 6,
+            0, 7, 2,
+            0, 4, 7,
+            4, 5, 6,
+            4, 6, 7
+        };
+
+        return video::mesh(vertices, 8, indices, 12);
+    }
+
+    video::mesh create_sphere(float32 _radius, int _rings, int _segments)
+    {
+        std::vector<glm::vec3> vertices;
+        for (int ring = 0; ring <= _rings; ++ring) {
+            float32 phi = glm::pi<float32>() * (float32)ring / (float32)_rings;
+            for (int segment = 0; segment <= _segments; ++segment) {
+                float32 theta = glm::two_pi<float32>() * (float32)segment / (float32)_segments;
+                vertices.push_back(glm::vec3(
+                    _radius * std::sin(phi) * std::cos(theta),
+                    _radius * std::cos(phi),
+                    _radius * std::sin(phi) * std::sin(theta)));
+            }
+        }
+
+        std::vector<uint16> indices;
+        int stride = _segments + 1;
+        for (int ring = 0; ring < _rings; ++ring) {
+            for (int segment = 0; segment < _segments; ++segment) {
+                uint16 a = (uint16)(ring * stride + segment);
+                uint16 b = (uint16)(a + 1);
+                uint16 c = (uint16)(a + stride);
+                uint16 d = (uint16)(c + 1);
+                indices.insert(indices.end(), { a, b, c, b, d, c });
+            }
+        }
+
+        return video::mesh(vertices.data(), (int)vertices.size(), indices.data(), (int)indices.size() / 3);
+    }
+
+    // a square in the xz plane facing +y, uv runs 0.._repeat across it
+    video::mesh create_floor(float32 _halfSize, float32 _repeat)
+    {
+        glm::vec3 vertices[4] = {
+            { -_halfSize, 0.f, _halfSize },
+            { _halfSize, 0.f, _halfSize },
+            { _halfSize, 0.f, -_halfSize },
+            { -_halfSize, 0.f, -_halfSize },
+        };
+
+        uint16 indices[6] = {
+            0, 1, 2,
+            0, 2, 3,
+        };
+
+        video::mesh result(vertices, 4, indices, 2);
+        result.m_varyingCount = 2;
+        result.m_varyings = {
+            0.f, 0.f,
+            _repeat, 0.f,
+            _repeat, _repeat,
+            0.f, _repeat,
+        };
+        return result;
+    }
+
+    // a rectangle in the xy plane facing +z, the texture is turned by _angle against it around _uvCenter
+    video::mesh create_quad(float32 _halfWidth, float32 _halfHeight, float32 _angle, glm::vec2 _uvCenter, float32 _uvPerUnit)
+    {
+        glm::vec3 vertices[4] = {
+            { -_halfWidth, -_halfHeight, 0.f },
+            { _halfWidth, -_halfHeight, 0.f },
+            { _halfWidth, _halfHeight, 0.f },
+            { -_halfWidth, _halfHeight, 0.f },
+        };
+
+        uint16 indices[6] = {
+            0, 1, 2,
+            0, 2, 3,
+        };
+
+        video::mesh result(vertices, 4, indices, 2);
+        result.m_varyingCount = 2;
+        float32 c = std::cos(_angle) * _uvPerUnit;
+        float32 s = std::sin(_angle) * _uvPerUnit;
+        for (const auto& vertex : vertices) {
+            result.m_varyings.push_back(_uvCenter.x + vertex.x * c - vertex.y * s);
+            result.m_varyings.push_back(_uvCenter.y - vertex.x * s - vertex.y * c);
+        }
+        return result;
+    }
+
+    // 256x256 with 32 texel checks, generated so benchmarks do not depend on image files
+    const video::texture* get_checker_texture()
+    {
+        static video::texture s_checker;
+        if (s_checker.get_level_count() == 0) {
+            const int size = 256;
+            std::vector<uint32> texels(size * size);
+            for (int y = 0; y < size; ++y) {
+                for (int x = 0; x < size; ++x) {
+                    bool odd = ((x / 32) ^ (y / 32)) & 1;
+                    texels[y * size + x] = odd ? 0xFF202020 : 0xFFE0E0E0;
+                }
+            }
+            s_checker.create(size, size, texels.data());
+        }
+        return &s_checker;
+    }
+
+    // shawn2.jpg from the working directory, the checker stands in when it does not load
+    const video::texture* get_photo_texture()
+    {
+        static video::texture s_photo;
+        static bool s_loaded = s_photo.load("shawn2.jpg");
+        return s_loaded ? &s_photo : get_checker_texture();
+    }
+
+    // 2048x2048 of busy texel data, 16 MB in level 0 so a screen's worth of it does not stay in cache
+    const video::texture* get_pattern_texture(video::texture::layout _layout)
+    {
+        static video::texture s_textures[2];
+        video::texture& result = s_textures[_layout == video::texture::layout::cBlocked ? 1 : 0];
+        if (result.get_level_count() == 0) {
+            const int size = 2048;
+            std::vector<uint32> texels(size * size);
+            for (int y = 0; y < size; ++y) {
+                for (int x = 0; x < size; ++x) {
+                    uint32 r = (uint32)(x ^ y) & 0xFF;
+                    uint32 g = (uint32)(x * 3 + y) & 0xFF;
+                    uint32 b = (uint32)(x + y * 5) & 0xFF;
+                    texels[y * size + x] = 0xFF000000 | (r << 16) | (g << 8) | b;
+                }
+            }
+            result.create(size, size, texels.data(), _layout);
+        }
+        return &result;
+    }
+
+    // three varyings per vertex, the direction from the bounding sphere's center mapped to rgb
+    void add_normal_colors(video::mesh& _mesh)
+    {
+        _mesh.m_varyingCount = 3;
+        _mesh.m_varyings.clear();
+        for (const auto& vertex : _mesh.m_vertices) {
+            glm::vec3 direction = vertex - _mesh.m_sphereCenter;
+            float32 length = glm::length(direction);
+            glm::vec3 normal = length > 0.f ? direction / length : glm::vec3(0.f, 1.f, 0.f);
+            _mesh.m_varyings.push_back(normal.x * 0.5f + 0.5f);
+            _mesh.m_varyings.push_back(normal.y * 0.5f + 0.5f);
+            _mesh.m_varyings.push_back(normal.z * 0.5f + 0.5f);
+        }
+    }
+
+    std::vector<benchmark_scene> create_benchmark_scenes()
+    {
+        std::vector<benchmark_scene> scenes(9);
+
+        scenes[0].m_name = "cube";
+        scenes[0].m_meshes.push_back(create_cube(3.f));
+        scenes[0].m_camera.m_position = glm::vec3(0.f, 0.f, 10.f);
+        scenes[0].m_camera.m_target = glm::vec3(0.f, 0.f, 0.f);
+
+        scenes[1].m_name = "sphere";
+        scenes[1].m_meshes.push_back(create_sphere(4.f, 96, 192));
+        scenes[1].m_camera.m_position = glm::vec3(0.f, 0.f, 10.f);
+        scenes[1].m_camera.m_target = glm::vec3(0.f, 0.f, 0.f);
+
+        scenes[2].m_name = "sphere_field";
+        for (int y = -2; y <= 2; ++y) {
+            for (int x = -2; x <= 2; ++x) {
+                scenes[2].m_meshes.push_back(create_sphere(1.5f, 32, 64));
+                scenes[2].m_meshes.back().m_position = glm::vec3(x * 4.f, y * 4.f, 0.f);
+            }
+        }
+        scenes[2].m_camera.m_position = glm::vec3(0.f, 0.f, 24.f);
+        scenes[2].m_camera.m_target = glm::vec3(0.f, 0.f, 0.f);
+
+        // a city block layout where most buildings sit outside the view
+        scenes[3].m_name = "cube_city";
+        for (int z = -20; z < 20; ++z) {
+            for (int x = -20; x < 20; ++x) {
+                scenes[3].m_meshes.push_back(create_cube(3.f));
+                scenes[3].m_meshes.back().m_position = glm::vec3(x * 10.f, 0.f, z * 10.f);
+            }
+        }
+        scenes[3].m_camera.m_position = glm::vec3(5.f, 2.f, 5.f);
+        scenes[3].m_camera.m_target = glm::vec3(5.f, 2.f, -40.f);
+
+        // the same city behind a row of large occluder blocks that hides most of it
+        scenes[4].m_name = "walled_city";
+        scenes[4].m_meshes = scenes[3].m_meshes;
+        for (int x = -6; x <= 6; ++x) {
+            scenes[4].m_meshes.push_back(create_cube(10.f));
+            scenes[4].m_meshes.back().m_position = glm::vec3(x * 20.f, 0.f, -25.f);
+            scenes[4].m_meshes.back().m_occluder = true;
+        }
+        scenes[4].m_camera = scenes[3].m_camera;
+
+        scenes[5].m_name = "shaded_sphere";
+        scenes[5].m_meshes.push_back(create_sphere(4.f, 96, 192));
+        add_normal_colors(scenes[5].m_meshes.back());
+        scenes[5].m_meshes.back().m_program = video::device::get_program<video::mesh_varyings<3>, video::vertex_colors>();
+        scenes[5].m_camera = scenes[1].m_camera;
+
+        // a floor running to the horizon, minified enough to need every mip level
+        scenes[6].m_name = "textured_floor";
+        scenes[6].m_meshes.push_back(create_floor(200.f, 64.f));
+        scenes[6].m_meshes.back().m_program = video::device::get_program<video::mesh_varyings<2>, video::textured<video::texture::filter::cTrilinear>>();
+        scenes[6].m_meshes.back().m_texture = get_checker_texture();
+        scenes[6].m_camera.m_position = glm::vec3(0.f, 3.f, 10.f);
+        scenes[6].m_camera.m_target = glm::vec3(0.f, 0.f, -30.f);
+
+        // one quad per screen quarter, each sampling its own quarter of the texture turned against the screen at
+        // one texel per pixel, so level 0 is read everywhere and the frame touches about 8 MB of distinct texels.
+        // the view at z = 0 spans 21.2 x 11.9 units from the camera, 90.5 pixels per unit at 1080 lines
+        scenes[7].m_name = "rotated_quads_linear";
+        scenes[8].m_name = "rotated_quads_blocked";
+        for (int i = 0; i < 2; ++i) {
+            auto& scene = scenes[7 + i];
+            auto layout = i == 0 ? video::texture::layout::cLinear : video::texture::layout::cBlocked;
+            const video::texture* texture = get_pattern_texture(layout);
+            float32 uvPerUnit = 90.5f / (float32)texture->get_width();
+            for (int quad = 0; quad < 4; ++quad) {
+                float32 angle = (quad * 2 + 1) * glm::pi<float32>() / 16.f;
+                glm::vec2 uvCenter((quad & 1) ? 0.75f : 0.25f, (quad & 2) ? 0.75f : 0.25f);
+                scene.m_meshes.push_back(create_quad(5.4f, 3.02f, angle, uvCenter, uvPerUnit));
+                scene.m_meshes.back().m_position = glm::vec3((quad & 1) ? 5.4f : -5.4f, (quad & 2) ? -3.02f : 3.02f, 0.f);
+                scene.m_meshes.back().m_program = video::device::get_program<video::mesh_varyings<2>, video::textured<video::texture::filter::cBilinear>>();
+                scene.m_meshes.back().m_texture = texture;
+            }
+            scene.m_camera.m_position = glm::vec3(0.f, 0.f, 10.f);
+            scene.m_camera.m_target = glm::vec3(0.f, 0.f, 0.f);
+            scene.m_animated = false;
+        }
+
+        return scenes;
+    }
+
+    sample_summary summarize(std::vector<float64> _samples)
+    {
+        sample_summary summary;
+        if (_samples.empty()) {
+            return summary;
+        }
+
+        std::sort(_samples.begin(), _samples.end());
+        size_t p99 = (size_t)std::ceil(_samples.size() * 0.99) - 1;
+
+        summary.m_min = _samples.front();
+        summary.m_median = _samples[_samples.size() / 2];
+        summary.m_p99 = _samples[std::min(p99, _samples.size() - 1)];
+        return summary;
+    }
+
+    const char* kernel_name(video::device::kernel_type _kernel)
+    {
+        switch (_kernel) {
+            case video::device::kernel_type::cAVX2: return "avx2";
+            case video::device::kernel_type::cSSE2: return "sse2";
+            default: return "scalar";
+        }
+    }
+
+    // renders straight into the device buffers and streams them out as ppm, no window or event loop
+    int run_headless(const options& _options)
+    {
+        int pixelSize = _options.m_pixelSize > 0 ? _options.m_pixelSize : 1;
+        video::device device(constants::width / pixelSize, constants::height / pixelSize);
+        device.set_cull_mode(video::device::cull_mode::cClockwise);
+        if (_options.m_hugePages) {
+            device.set_page_mode(memory::page_mode::cExplicitHuge);
+        }
+
+        video::mesh cubeMesh = create_cube(3.f);
+
+        video::camera defaultCamera;
+        defaultCamera.m_position = glm::vec3(0.f, 0.f, 10.f);
+        defaultCamera.m_target = glm::vec3(0.f, 0.f, 0.f);
+
+        int frames = _options.m_frames > 0 ? _options.m_frames : 1;
+        std::string output = _options.m_output.empty() ? "frame" : _options.m_output;
+        bool toStdout = output == "-";
+#if defined(_WIN32)
+        if (toStdout) {
+            _setmode(_fileno(stdout), _O_BINARY);
+        }
+#endif
+
+        auto geometry = [&](int _frame, int _set) {
+            cubeMesh.m_rotation = constants::rotationStep * (float32)_frame;
+            device.prepare(defaultCamera, &cubeMesh, 1, _set);
+        };
+
+        // frames are written on the present thread in the order they were rendered, after a failure the rest are skipped
+        std::atomic<bool> failed{ false };
+        int written = 0;
+        video::swap_chain swapChain(_options.m_buffers, [&](const uint32* _colors, int _width, int _height, int _pitch) {
+            int frame = written++;
+            if (failed) {
+                return;
+            }
+
+            if (toStdout) {
+                failed = !image::write_ppm(std::cout, _colors, _width, _height, _pitch);
+                return;
+            }
+
+            char suffix[16];
+            snprintf(suffix, sizeof(suffix), "%04d.ppm", frame);
+            std::string path = output + suffix;
+
+            std::ofstream file(path, std::ios::binary);
+            if (!file || !image::write_ppm(file, _colors, _width, _height, _pitch)) {
+                std::cerr << "unable to write " << path << "\n";
+                failed = true;
+            }
+        });
+
+        auto raster = [&](int, int _set) {
+            swapChain.acquire(device);
+            device.clear();
+            device.rasterize(_set);
+            swapChain.present(device);
+        };
+
+        if (_options.m_pipeline) {
+            video::frame_pipeline pipeline;
+            pipeline.run(frames, geometry, raster);
+        }
+        else {
+            for (int frame = 0; frame < frames && !failed; ++frame) {
+                geometry(frame, 0);
+                raster(frame, 0);
+            }
+        }
+
+        swapChain.flush();
+        std::cout.flush();
+        return failed ? 1 : 0;
+    }
+
+    // renders every benchmark scene for a fixed number of frames and reports per stage timings
+    int run_benchmark(const options& _options)
+    {
+        int pixelSize = _options.m_pixelSize > 0 ? _options.m_pixelSize : 1;
+        int frames = _options.m_frames > 0 ? _options.m_frames : 200;
+
+        video::device device(constants::width / pixelSize, constants::height / pixelSize);
+        device.set_cull_mode(video::device::cull_mode::cClockwise);
+        if (_options.m_hugePages) {
+            device.set_page_mode(memory::page_mode::cExplicitHuge);
+        }
+        std::vector<uint32> staging(device.get_size());
+
+        std::ofstream file;
+        if (!_options.m_output.empty() && _options.m_output != "-") {
+            file.open(_options.m_output);
+            if (!file) {
+                std::cerr << "unable to write " << _options.m_output << "\n";
+                return 1;
+            }
+        }
+        std::ostream& out = file.is_open() ? file : std::cout;
+
+        const char* stageNames[] = { "frame", "clear", "transform", "rasterize", "present" };
+        const int stageCount = 5;
+
+        if (_options.m_csv) {
+            out << "scene,stage,min_ms,median_ms,p99_ms,triangles_per_second,pixels_per_second\n";
+        }
+        else {
+            out << "{\n"
+                << "  \"kernel\": \"" << kernel_name(device.get_kernel()) << "\",\n"
+                << "  \"threads\": " << device.get_thread_count() << ",\n"
+                << "  \"pipeline\": " << (_options.m_pipeline ? "true" : "false") << ",\n"
+                << "  \"width\": " << device.get_width() << ",\n"
+                << "  \"height\": " << device.get_height() << ",\n"
+                << "  \"frames\": " << frames << ",\n"
+                << "  \"scenes\": [";
+        }
+
+        auto scenes = create_benchmark_scenes();
+        for (size_t sceneIndex = 0; sceneIndex < scenes.size(); ++sceneIndex) {
+            auto& scene = scenes[sceneIndex];
+
+            std::vector<float64> samples[stageCount];
+            uint64 triangles = 0;
+            uint64 culled = 0;
+            uint64 meshesCulled = 0;
+            uint64 meshesOccluded = 0;
+            uint64 pixels = 0;
+            uint64 blocksRejected = 0;
+            float64 totalMs = 0.0;
+
+            auto geometry = [&](int _frame, int _set) {
+                for (auto& mesh : scene.m_meshes) {
+                    mesh.m_rotation = scene.m_animated ? constants::rotationStep * (float32)_frame : glm::vec3(0.f);
+                }
+                device.prepare(scene.m_camera, scene.m_meshes.data(), (int)scene.m_meshes.size(), _set);
+            };
+
+            // frame time is measured between frame completions, which is the throughput in pipelined mode
+            auto frameStart = timing::clock::now();
+            auto raster = [&](int, int _set) {
+                auto clearStart = timing::clock::now();
+                device.clear();
+                float64 clearMs = timing::elapsed_ms(clearStart);
+
+                device.rasterize(_set);
+
+                auto presentStart = timing::clock::now();
+                device.copy_colors(staging.data(), device.get_width());
+                float64 presentMs = timing::elapsed_ms(presentStart);
+
+                float64 frameMs = timing::elapsed_ms(frameStart);
+                frameStart = timing::clock::now();
+                const auto& stats = device.get_stats();
+
+                samples[0].push_back(frameMs);
+                samples[1].push_back(clearMs);
+                samples[2].push_back(stats.m_transformMs);
+                samples[3].push_back(stats.m_rasterizeMs);
+                samples[4].push_back(presentMs);
+
+                triangles += stats.m_triangles;
+                culled += stats.m_trianglesCulled;
+                meshesCulled += stats.m_meshesCulled;
+                meshesOccluded += stats.m_meshesOccluded;
+                pixels += stats.m_pixels;
+                blocksRejected += stats.m_blocksRejected;
+                totalMs += frameMs;
+            };
+
+            if (_options.m_pipeline) {
+                video::frame_pipeline pipeline;
+                pipeline.run(frames, geometry, raster);
+            }
+            else {
+                for (int frame = 0; frame < frames; ++frame) {
+                    geometry(frame, 0);
+                    raster(frame, 0);
+                }
+            }
+
+            float64 seconds = std::max(totalMs / 1000.0, 1e-9);
+            float64 trianglesPerSecond = triangles / seconds;
+            float64 pixelsPerSecond = pixels / seconds;
+
+            if (_options.m_csv) {
+                for (int stage = 0; stage < stageCount; ++stage) {
+                    auto summary = summarize(samples[stage]);
+                    out << scene.m_name << "," << stageNames[stage] << ","
+                        << summary.m_min << "," << summary.m_median << "," << summary.m_p99 << ","
+                        << trianglesPerSecond << "," << pixelsPerSecond << "\n";
+                }
+                continue;
+            }
+
+            out << (sceneIndex == 0 ? "\n" : ",\n")
+                << "    {\n"
+                << "      \"name\": \"" << scene.m_name << "\",\n"
+                << "      \"triangles_per_frame\": " << triangles / frames << ",\n"
+                << "      \"meshes_per_frame\": " << scene.m_meshes.size() << ",\n"
+                << "      \"meshes_culled_per_frame\": " << meshesCulled / frames << ",\n"
+                << "      \"meshes_occluded_per_frame\": " << meshesOccluded / frames << ",\n"
+                << "      \"triangles_culled_per_frame\": " << culled / frames << ",\n"
+                << "      \"pixels_per_frame\": " << pixels / frames << ",\n"
+                << "      \"blocks_rejected_per_frame\": " << blocksRejected / frames << ",\n"
+                << "      \"triangles_per_second\": " << trianglesPerSecond << ",\n"
+                << "      \"pixels_per_second\": " << pixelsPerSecond;
+
+            for (int stage = 0; stage < stageCount; ++stage) {
+                auto summary = summarize(samples[stage]);
+                out << ",\n      \"" << stageNames[stage] << "\": { "
+                    << "\"min_ms\": " << summary.m_min << ", "
+                    << "\"median_ms\": " << summary.m_median << ", "
+                    << "\"p99_ms\": " << summary.m_p99 << " }";
             }
+
+            out << "\n    }";
+        }
+
+        if (!_options.m_csv) {
+            out << "\n  ]\n}\n";
+        }
+
+        return out.good() ? 0 : 1;
+    }
+
+    int run_interactive(const options& _options)
+    {
+        SDL_Window* window = SDL_CreateWindow("Soft Renderer", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, constants::width, constants::height, SDL_WINDOW_SHOWN);
+
+        int pixelSize = _options.m_pixelSize > 0 ? _options.m_pixelSize : 30;
+        video::device device(constants::width / pixelSize, constants::height / pixelSize);
+        device.set_cull_mode(video::device::cull_mode::cClockwise);
+        if (_options.m_hugePages) {
+            device.set_page_mode(memory::page_mode::cExplicitHuge);
         }
 
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-        SDL_RenderClear(renderer);
-        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+        // -/= step down to a pixel size of 1, reserving for it up front keeps every step in one allocation
+        device.reserve(constants::width, constants::height);
+
+        // the cube turns in front of a textured backdrop
+        std::vector<video::mesh> meshes;
+        meshes.push_back(create_cube(3.f));
+        meshes.push_back(create_quad(12.f, 12.f, 0.f, glm::vec2(0.5f, 0.5f), 1.f / 24.f));
+        meshes.back().m_position = glm::vec3(0.f, 0.f, -6.f);
+        meshes.back().m_program = video::device::get_program<video::mesh_varyings<2>, video::textured<video::texture::filter::cTrilinear>>();
+        meshes.back().m_texture = get_photo_texture();
+        video::mesh& cubeMesh = meshes[0];
+
+        bool isRunning = true;
+
+        video::camera defaultCamera;
+        defaultCamera.m_position = glm::vec3(0.f, 0.f, 10.f);
+        defaultCamera.m_target = glm::vec3(0.f, 0.f, 0.f);
 
-        device.clear();
+        glm::vec3 pa1(constants::width / pixelSize / 2, 20, 3);
+        glm::vec3 pa2(pa1.x - 30, pa1.y + 40, 3);
+        glm::vec3 pa3(pa1.x + 30, pa1.y + 40, 3);
 
-        device.render(defaultCamera, &cubeMesh, 1);
-        //device.draw_triangle(pa1, pa2, pa3, video::color::s_blue);
-        //device.draw_triangle(pb1, pb2, pb3, video::color::s_green);
+        glm::vec3 pb1(pa1.x + 20, pa1.y, 5);
+        glm::vec3 pb2(pb1.x - 30, pb1.y + 45, 1);
+        glm::vec3 pb3(pb1.x + 30, pb1.y + 40, 5);
 
-        cubeMesh.m_rotation.x += 0.0023f;
-        cubeMesh.m_rotation.y += 0.001f;
+        SDL_Renderer* renderer = SDL_CreateRenderer(window, 0, SDL_RENDERER_ACCELERATED);
+        std::unique_ptr<video::presenter> presenter(new video::presenter(renderer));
 
-        //SDL_Surface* surface = device.create_surface(video::device::buffer_type::cColor);
-        //SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, surface);
+        // SDL calls stay on the main thread. the present thread offers each finished buffer in the mailbox and holds
+        // it until the main loop has uploaded it, so frames go to the texture straight from the swap chain
+        std::mutex mailboxMutex;
+        std::condition_variable mailboxChanged;
+        const uint32* mailboxColors = nullptr;
+        int mailboxWidth = 0;
+        int mailboxHeight = 0;
+        int mailboxPitch = 0;
+        bool quitting = false;
+        auto present = [&](const uint32* _colors, int _width, int _height, int _pitch) {
+            std::unique_lock<std::mutex> lock(mailboxMutex);
+            if (quitting) {
+                return;
+            }
+
+            mailboxColors = _colors;
+            mailboxWidth = _width;
+            mailboxHeight = _height;
+            mailboxPitch = _pitch;
+            mailboxChanged.notify_all();
+            mailboxChanged.wait(lock, [&]() { return quitting || !mailboxColors; });
+        };
+        std::unique_ptr<video::swap_chain> swapChain(new video::swap_chain(_options.m_buffers, present));
+
+        // the device belongs to the render thread, the main loop only asks for resizes
+        std::atomic<bool> rendering{ true };
+        std::atomic<int> requestedPixelSize{ pixelSize };
+        std::thread renderThread([&, initialPixelSize = pixelSize]() {
+            int appliedPixelSize = initialPixelSize;
+            while (rendering) {
+                int nextPixelSize = requestedPixelSize;
+                if (nextPixelSize != appliedPixelSize) {
+                    appliedPixelSize = nextPixelSize;
+                    device.resize(constants::width / appliedPixelSize, constants::height / appliedPixelSize);
+                }
+
+                swapChain->acquire(device);
+                device.clear();
+
+                device.render(defaultCamera, meshes.data(), (int)meshes.size());
+                //device.draw_triangle(pa1, pa2, pa3, video::color::s_blue);
+                //device.draw_triangle(pb1, pb2, pb3, video::color::s_green);
+
+                cubeMesh.m_rotation.x += 0.0023f;
+                cubeMesh.m_rotation.y += 0.001f;
+
+                swapChain->present(device);
+            }
+        });
+
+        while (isRunning) {
+            SDL_Event event;
+            while (SDL_PollEvent(&event)) {
+                switch (event.type) {
+                case SDL_KEYDOWN:
+                    switch (event.key.keysym.scancode) {
+                        case SDL_SCANCODE_ESCAPE:
+                            isRunning = false;
+                            break;
+
+                        case SDL_SCANCODE_MINUS:
+                            pixelSize--;
+                            pixelSize = std::max(pixelSize, 1);
+                            requestedPixelSize = pixelSize;
+                            break;
+
+                        case SDL_SCANCODE_EQUALS:
+                            pixelSize++;
+                            pixelSize = std::min(pixelSize, 128);
+                            requestedPixelSize = pixelSize;
+                            break;
+                        default:
+                            break;
+                    }
+                    break;
+
+                case SDL_QUIT:
+                    isRunning = false;
+                    break;
+                }
+            }
 
-        //SDL_RenderCopy(renderer, texture, nullptr, nullptr);
+            const uint32* shown = nullptr;
+            int shownWidth = 0;
+            int shownHeight = 0;
+            int shownPitch = 0;
+            {
+                std::unique_lock<std::mutex> lock(mailboxMutex);
+                mailboxChanged.wait_for(lock, std::chrono::milliseconds(10), [&]() { return mailboxColors != nullptr; });
+                shown = mailboxColors;
+                shownWidth = mailboxWidth;
+                shownHeight = mailboxHeight;
+                shownPitch = mailboxPitch;
+            }
 
-        for (int i = 0; i < device.get_size(); ++i) {
-            uint32 c = device.get_colors()[i];
-            if ((c & 0x00FFFFFF) > 0) {
-                int x, y;
-                device.xy_from_index(i, x, y);
+            if (!shown) {
+                continue;
+            }
 
-                SDL_Rect r {
-                    x * pixelSize, y * pixelSize,
-                    pixelSize, pixelSize,
-                };
+            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+            SDL_RenderClear(renderer);
+            SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
 
-                video::color col(c);
+            // the largest whole scale that fits, which is the pixel size the frame was rendered with
+            int scale = std::max(std::min(constants::width / shownWidth, constants::height / shownHeight), 1);
+            SDL_Rect destination {
+                0, 0,
+                shownWidth * scale, shownHeight * scale,
+            };
+            presenter->present(shown, shownWidth, shownHeight, shownPitch, &destination);
 
-                SDL_RenderCopy(renderer, shawnTexture, nullptr, &r);
+            // the buffer goes back to the swap chain as soon as it is uploaded, vsync no longer holds it
+            {
+                std::lock_guard<std::mutex> lock(mailboxMutex);
+                mailboxColors = nullptr;
             }
+            mailboxChanged.notify_all();
+
+            SDL_RenderPresent(renderer);
+        }
+
+        // releasing the mailbox unblocks the present thread, which in turn frees buffers for a render thread stuck in
+        // acquire. both are joined before the device and the renderer go
+        rendering = false;
+        {
+            std::lock_guard<std::mutex> lock(mailboxMutex);
+            quitting = true;
         }
+        mailboxChanged.notify_all();
+        renderThread.join();
+        swapChain.reset();
+        presenter.reset();
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
 
-        //SDL_DestroyTexture(texture);
-        //SDL_FreeSurface(surface);
+        return 0;
+    }
+}
 
-        SDL_RenderPresent(renderer);
+int main(int argc, char* argv[])
+{
+    app::options options;
+    if (!app::parse_options(argc, argv, options)) {
+        return 1;
     }
 
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroyWindow(window);
+    // 0 keeps one worker per hardware thread
+    jobs::scheduler::set_default_thread_count(options.m_threads);
+
+    if (options.m_benchmark) {
+        return app::run_benchmark(options);
+    }
 
-    return 0;
+    return options.m_headless ? app::run_headless(options) : app::run_interactive(options);
 }